@@ -0,0 +1,1344 @@
+#ifndef BTREE_MAP_H
+#define BTREE_MAP_H
+
+#include <algorithm>        // std::max
+#include <cstddef>          // size_t, ptrdiff_t
+#include <cstdint>          // int32_t, int64_t
+#include <cstring>          // std::memset
+#include <functional>       // std::less
+#include <initializer_list> // initializer_list
+#include <iterator>         // bidirectional iterator tag
+#include <memory>           // std::allocator, std::allocator_traits
+#include <new>              // placement new
+#include <stdexcept>        // std::out_of_range
+#include <tuple>            // std::forward_as_tuple
+#include <type_traits>      // std::is_integral, std::is_trivially_copyable
+#include <utility>          // std::move, std::pair
+#ifdef __SSE2__
+#include <emmintrin.h>      // _mm_cmpgt_epi32
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>      // _mm_cmpgt_epi64
+#endif
+
+// Ordered map stored as a B+ tree. Nodes hold many keys each and take a few
+// cache lines, so a lookup touches a handful of nodes where Map follows a
+// pointer per level. The elements live in the leaves, which are linked in
+// key order for iteration, and inner nodes hold only keys and child pointers.
+//
+// Inner node keys are kept contiguous. For integer keys ordered by std::less
+// they are searched with SSE2 (SSE4.2 for 64-bit keys), other searches use a
+// branchless binary search.
+//
+// The API follows Map, with one difference that comes with storing elements
+// in arrays: an insert or erase moves elements within and between nodes, so
+// it invalidates every iterator, pointer and reference into the map
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>>
+class BTreeMap {
+    private:
+        struct Node;
+        struct Leaf;
+        struct Internal;
+
+        // Bidirectional iterator
+        template<typename _Tp>
+        class BTree_iterator;
+
+    public:
+        using key_type               = Key;
+        using mapped_type            = T;
+        using value_type             = std::pair<const Key, T>;
+        using key_compare            = Compare;
+        using allocator_type         = Allocator;
+
+        using reference              = value_type&;
+        using const_reference        = const value_type&;
+        using pointer                = value_type*;
+        using const_pointer          = const value_type*;
+
+        using iterator               = BTree_iterator<value_type>;
+        using const_iterator         = BTree_iterator<const value_type>;
+        using reverse_iterator       = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    private:
+        // Elements are stored with a mutable key so that they can be moved
+        // between slots, and handed out as value_type, which has the same
+        // layout
+        using slot_type = std::pair<Key, T>;
+
+        // Nodes are sized to about four cache lines. Inner nodes keep a
+        // multiple of four keys so SIMD searches can read whole vectors
+        static constexpr size_t nodeBytes = 256;
+        static constexpr size_t leafSlots = std::max<size_t>(4, (nodeBytes - 3 * sizeof(void*)) / sizeof(slot_type));
+        static constexpr size_t internalSlots = std::max<size_t>(4, (nodeBytes - 2 * sizeof(void*)) / (sizeof(Key) + sizeof(void*)) / 4 * 4);
+
+        // A node below these counts after an erase takes an element from a
+        // sibling or is merged with it. An inner node split leaves one half
+        // with a key less than the other, since one key moves up
+        static constexpr size_t minLeaf = leafSlots / 2;
+        static constexpr size_t minInternal = internalSlots / 2 - 1;
+
+        // Enough for any tree, since every inner node has at least two
+        // children
+        static constexpr size_t maxHeight = 64;
+
+        struct Node {
+            unsigned short count;   // Elements in a leaf, keys in an inner node
+            bool leaf;
+
+            explicit Node(bool isLeaf): count(0), leaf(isLeaf) {}
+        };
+
+        struct Leaf : Node {
+            Leaf* prev;
+            Leaf* next;
+            alignas(slot_type) unsigned char storage[leafSlots * sizeof(slot_type)];
+
+            Leaf(): Node(true), prev(nullptr), next(nullptr) {}
+
+            slot_type* slot(size_t i) { return reinterpret_cast<slot_type*>(storage) + i; }
+            const slot_type* slot(size_t i) const { return reinterpret_cast<const slot_type*>(storage) + i; }
+            value_type& value(size_t i) { return *reinterpret_cast<value_type*>(slot(i)); }
+            const Key& key(size_t i) const { return slot(i)->first; }
+        };
+
+        // children[i] holds the keys less than key(i), and children[i + 1]
+        // the keys not less than it
+        struct Internal : Node {
+            Node* children[internalSlots + 1];
+            alignas(Key) unsigned char storage[internalSlots * sizeof(Key)];
+
+            // The key storage is zeroed so SIMD searches never read
+            // uninitialized memory past the last key
+            Internal(): Node(false) {
+                std::memset(storage, 0, sizeof(storage));
+            }
+
+            Key* keys() { return reinterpret_cast<Key*>(storage); }
+            const Key* keys() const { return reinterpret_cast<const Key*>(storage); }
+            Key& key(size_t i) { return keys()[i]; }
+            const Key& key(size_t i) const { return keys()[i]; }
+        };
+
+        using leaf_allocator     = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+        using leaf_traits        = std::allocator_traits<leaf_allocator>;
+        using internal_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Internal>;
+        using internal_traits    = std::allocator_traits<internal_allocator>;
+
+        // Inner nodes passed on the way down to a leaf, with the index of the
+        // child taken in each
+        struct Path {
+            Internal* nodes[maxHeight];
+            size_t index[maxHeight];
+            size_t depth = 0;
+        };
+
+        template<typename _Tp>
+        class BTree_iterator {
+            public:
+                using iterator_category     = std::bidirectional_iterator_tag;
+                using difference_type       = ptrdiff_t;
+
+                using value_type            = _Tp;
+                using pointer               = _Tp*;
+                using reference             = _Tp&;
+
+                using _Self                 = BTree_iterator<_Tp>;
+
+            private:
+                friend class BTreeMap<Key, T, Compare, Allocator>;
+                template<typename _Up>
+                friend class BTree_iterator;
+
+                // end() is one past the last element of the last leaf, and
+                // (nullptr, 0) in an empty map
+                Leaf* leaf;
+                size_t index;
+
+                BTree_iterator(Leaf* l, size_t i) noexcept: leaf{l}, index{i} {}
+
+            public:
+                BTree_iterator() noexcept: leaf{nullptr}, index{0} {}
+                // Converts an iterator into a const_iterator
+                template<typename _Up, typename = typename std::enable_if<std::is_same<const _Up, _Tp>::value && !std::is_same<_Up, _Tp>::value>::type>
+                BTree_iterator(const BTree_iterator<_Up>& other) noexcept: leaf{other.leaf}, index{other.index} {}
+
+                reference operator*() const { return leaf->value(index); }
+                pointer operator->() const { return &leaf->value(index); }
+
+                // Prefix Increment: ++a
+                _Self& operator++() {
+                    if (++index == leaf->count && leaf->next) {
+                        leaf = leaf->next;
+                        index = 0;
+                    }
+
+                    return *this;
+                }
+                // Postfix Increment: a++
+                _Self operator++(int) {
+                    _Self temp(*this);
+                    ++(*this);
+
+                    return temp;
+                }
+                // Prefix Decrement: --a
+                _Self& operator--() {
+                    if (index == 0) {
+                        leaf = leaf->prev;
+                        index = leaf->count;
+                    }
+                    index--;
+
+                    return *this;
+                }
+                // Postfix Decrement: a--
+                _Self operator--(int) {
+                    _Self temp(*this);
+                    --(*this);
+
+                    return temp;
+                }
+
+                // Iterators and const_iterators compare with each other
+                template<typename _Up>
+                bool operator==(const BTree_iterator<_Up>& other) const noexcept { return leaf == other.leaf && index == other.index; }
+                template<typename _Up>
+                bool operator!=(const BTree_iterator<_Up>& other) const noexcept { return !(*this == other); }
+        };
+
+        Node* _root;
+        Leaf* _first;
+        Leaf* _last;
+        size_t _size;
+        Compare _comp;
+        leaf_allocator _leafAlloc;
+        internal_allocator _internalAlloc;
+
+        //////////////////////
+        // HELPER FUNCTIONS //
+        //////////////////////
+
+        Leaf* createLeaf() {
+            Leaf* leaf = leaf_traits::allocate(_leafAlloc, 1);
+            ::new (static_cast<void*>(leaf)) Leaf();
+            return leaf;
+        }
+
+        Internal* createInternal() {
+            Internal* node = internal_traits::allocate(_internalAlloc, 1);
+            ::new (static_cast<void*>(node)) Internal();
+            return node;
+        }
+
+        // Frees a node without touching its elements or children
+        void freeNode(Node* node) {
+            if (node->leaf) {
+                leaf_traits::deallocate(_leafAlloc, static_cast<Leaf*>(node), 1);
+            } else {
+                internal_traits::deallocate(_internalAlloc, static_cast<Internal*>(node), 1);
+            }
+        }
+
+        // Helper function for deleting a tree. Children may be missing in a
+        // tree whose copy was cut short by an exception
+        void deleteHelper(Node* node) {
+            if (node == nullptr) {
+                return;
+            }
+
+            if (node->leaf) {
+                Leaf* leaf = static_cast<Leaf*>(node);
+                for (size_t i = 0; i < leaf->count; i++) {
+                    leaf->slot(i)->~slot_type();
+                }
+            } else {
+                Internal* in = static_cast<Internal*>(node);
+                for (size_t i = 0; i < in->count; i++) {
+                    in->key(i).~Key();
+                }
+                for (size_t i = 0; i <= in->count; i++) {
+                    deleteHelper(in->children[i]);
+                }
+            }
+
+            freeNode(node);
+        }
+
+        // Moves the object at src into the raw slot dst and destroys src.
+        // Trivially copyable objects are moved with memcpy
+        template<typename U>
+        static void relocate(U* dst, U* src) {
+            if constexpr (std::is_trivially_copyable<U>::value) {
+                std::memcpy(static_cast<void*>(dst), static_cast<const void*>(src), sizeof(U));
+            } else {
+                ::new (static_cast<void*>(dst)) U(std::move(*src));
+                src->~U();
+            }
+        }
+
+        // Relocates the n objects starting at src to dst, which may overlap
+        // src on either side
+        template<typename U>
+        static void relocateRange(U* dst, U* src, size_t n) {
+            if constexpr (std::is_trivially_copyable<U>::value) {
+                std::memmove(static_cast<void*>(dst), static_cast<const void*>(src), n * sizeof(U));
+            } else if (dst < src) {
+                for (size_t i = 0; i < n; i++) {
+                    relocate(dst + i, src + i);
+                }
+            } else {
+                for (size_t i = n; i > 0; i--) {
+                    relocate(dst + i - 1, src + i - 1);
+                }
+            }
+        }
+
+        ////////////////////
+        // SEARCH HELPERS //
+        ////////////////////
+
+        // True if inner nodes are searched with SIMD: integer keys ordered by
+        // std::less, looked up with the key type itself
+        template<typename K>
+        static constexpr bool simdSearch() {
+            if constexpr (std::is_same<K, Key>::value && std::is_integral<Key>::value && !std::is_same<Key, bool>::value
+                          && (std::is_same<Compare, std::less<Key>>::value || std::is_same<Compare, std::less<>>::value)) {
+#ifdef __SSE2__
+                if (sizeof(Key) == 4) {
+                    return true;
+                }
+#endif
+#ifdef __SSE4_2__
+                if (sizeof(Key) == 8) {
+                    return true;
+                }
+#endif
+            }
+            return false;
+        }
+
+        // Number of the n sorted keys that are not greater than x. The keys
+        // are sorted, so this is the position of the first lane greater than
+        // x, and the scan stops at the first vector that has one. Lanes past
+        // the last key hold leftover values and are cut off by n. The vectors
+        // compare as signed, so unsigned keys have their sign bit flipped
+        static size_t simdUpperCount(const Key* keys, size_t n, Key x) {
+            if constexpr (sizeof(Key) == 4) {
+#ifdef __SSE2__
+                const int32_t flip = std::is_signed<Key>::value ? 0 : INT32_MIN;
+                const __m128i vflip = _mm_set1_epi32(flip);
+                const __m128i vx = _mm_set1_epi32(static_cast<int32_t>(x) ^ flip);
+
+                for (size_t i = 0; i < n; i += 4) {
+                    __m128i k = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), vflip);
+                    int greater = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, vx)));
+
+                    if (greater != 0) {
+                        return std::min<size_t>(i + __builtin_ctz(greater), n);
+                    }
+                }
+#endif
+            } else {
+#ifdef __SSE4_2__
+                const int64_t flip = std::is_signed<Key>::value ? 0 : INT64_MIN;
+                const __m128i vflip = _mm_set1_epi64x(flip);
+                const __m128i vx = _mm_set1_epi64x(static_cast<int64_t>(x) ^ flip);
+
+                for (size_t i = 0; i < n; i += 2) {
+                    __m128i k = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), vflip);
+                    int greater = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, vx)));
+
+                    if (greater != 0) {
+                        return std::min<size_t>(i + __builtin_ctz(greater), n);
+                    }
+                }
+#endif
+            }
+
+            return n;
+        }
+
+        // Branchless binary search for the number of the n sorted keys
+        // key(0), ..., key(n - 1) for which before(key) holds. The halving
+        // compiles to conditional moves, so there are no mispredicted
+        // branches on the way
+        template<typename KeyAt, typename Before>
+        static size_t countBefore(size_t n, KeyAt key, Before before) {
+            if (n == 0) {
+                return 0;
+            }
+
+            size_t base = 0;
+            while (n > 1) {
+                size_t half = n / 2;
+                base = before(key(base + half)) ? base + half : base;
+                n -= half;
+            }
+
+            return base + (before(key(base)) ? 1 : 0);
+        }
+
+        // Index of the child of node that may hold x
+        template<typename K>
+        size_t childIndex(const Internal* node, const K& x) const {
+            if constexpr (simdSearch<K>()) {
+                return simdUpperCount(node->keys(), node->count, x);
+            } else {
+                return countBefore(node->count,
+                                   [node](size_t i) -> const Key& { return node->key(i); },
+                                   [this, &x](const Key& k) { return !_comp(x, k); });
+            }
+        }
+
+        // Number of elements of leaf with a key less than x
+        template<typename K>
+        size_t leafLower(const Leaf* leaf, const K& x) const {
+            return countBefore(leaf->count,
+                               [leaf](size_t i) -> const Key& { return leaf->key(i); },
+                               [this, &x](const Key& k) { return _comp(k, x); });
+        }
+
+        // Number of elements of leaf with a key not greater than x
+        template<typename K>
+        size_t leafUpper(const Leaf* leaf, const K& x) const {
+            return countBefore(leaf->count,
+                               [leaf](size_t i) -> const Key& { return leaf->key(i); },
+                               [this, &x](const Key& k) { return !_comp(x, k); });
+        }
+
+        // The leaf that holds x if it is in the map, recording the way down
+        // in path if one is given
+        template<typename K>
+        Leaf* descendHelper(const K& x, Path* path) const {
+            Node* node = _root;
+
+            while (!node->leaf) {
+                Internal* in = static_cast<Internal*>(node);
+                size_t i = childIndex(in, x);
+
+                if (path) {
+                    path->nodes[path->depth] = in;
+                    path->index[path->depth] = i;
+                    path->depth++;
+                }
+                node = in->children[i];
+            }
+
+            return static_cast<Leaf*>(node);
+        }
+
+        // An iterator to position i of leaf, moved on to the next leaf if i
+        // is past the end of a leaf that is not the last
+        iterator iteratorAt(Leaf* leaf, size_t i) const {
+            if (i == leaf->count && leaf->next) {
+                return iterator(leaf->next, 0);
+            }
+
+            return iterator(leaf, i);
+        }
+
+        template<typename K>
+        iterator findHelper(const K& x) const {
+            if (_root == nullptr) {
+                return end_();
+            }
+
+            Leaf* leaf = descendHelper(x, nullptr);
+            size_t i = leafLower(leaf, x);
+
+            if (i < leaf->count && !_comp(x, leaf->key(i))) {
+                return iterator(leaf, i);
+            }
+
+            return end_();
+        }
+
+        template<typename K>
+        iterator lowerBoundHelper(const K& x) const {
+            if (_root == nullptr) {
+                return end_();
+            }
+
+            Leaf* leaf = descendHelper(x, nullptr);
+            return iteratorAt(leaf, leafLower(leaf, x));
+        }
+
+        // Greatest element with a key not greater than x, like
+        // Map::upper_bound, or end() if there is none
+        template<typename K>
+        iterator upperBoundHelper(const K& x) const {
+            if (_root == nullptr) {
+                return end_();
+            }
+
+            Leaf* leaf = descendHelper(x, nullptr);
+            size_t i = leafUpper(leaf, x);
+
+            if (i > 0) {
+                return iterator(leaf, i - 1);
+            }
+            if (leaf->prev) {
+                return iterator(leaf->prev, leaf->prev->count - 1);
+            }
+
+            return end_();
+        }
+
+        iterator end_() const {
+            return _last ? iterator(_last, _last->count) : iterator();
+        }
+
+        ////////////////////
+        // INSERT HELPERS //
+        ////////////////////
+
+        // An element built outside the tree before it is moved into its slot,
+        // so that a throwing constructor or allocation leaves the tree as it was
+        struct PendingSlot {
+            union { slot_type value; };
+            bool live = false;
+
+            PendingSlot() {}
+
+            slot_type* get() { return &value; }
+
+            ~PendingSlot() {
+                if (live) {
+                    value.~slot_type();
+                }
+            }
+        };
+
+        // Helper function for every insert. Returns the element with key k
+        // and false if it exists. Otherwise constructs a new element with
+        // make(void*) and returns it with true
+        template<typename Make>
+        std::pair<iterator, bool> insertHelper(const key_type& k, Make make) {
+            if (_root == nullptr) {
+                Leaf* leaf = createLeaf();
+
+                try {
+                    make(static_cast<void*>(leaf->slot(0)));
+                } catch (...) {
+                    freeNode(leaf);
+                    throw;
+                }
+
+                leaf->count = 1;
+                _root = _first = _last = leaf;
+                _size = 1;
+                return std::pair<iterator, bool>(iterator(leaf, 0), true);
+            }
+
+            Path path;
+            Leaf* leaf = descendHelper(k, &path);
+            size_t i = leafLower(leaf, k);
+
+            if (i < leaf->count && !_comp(k, leaf->key(i))) {
+                return std::pair<iterator, bool>(iterator(leaf, i), false);
+            }
+
+            PendingSlot pending;
+            make(static_cast<void*>(pending.get()));
+            pending.live = true;
+
+            // k may have been moved into the new element
+            if (leaf->count == leafSlots) {
+                splitLeafHelper(path, leaf, i, pending.get()->first);
+            }
+
+            relocateRange(leaf->slot(i + 1), leaf->slot(i), leaf->count - i);
+            relocate(leaf->slot(i), pending.get());
+            pending.live = false;
+            leaf->count++;
+            _size++;
+
+            return std::pair<iterator, bool>(iterator(leaf, i), true);
+        }
+
+        // Splits the full leaf so the new element at position i fits, and
+        // points leaf and i at where it goes. Every node the split needs is
+        // allocated before anything is changed. Inserting past the end of
+        // the last leaf, or before the start of the first, leaves the old
+        // leaf full instead of half full, which packs sorted input tightly
+        void splitLeafHelper(Path& path, Leaf*& leaf, size_t& i, const key_type& k) {
+            size_t full = 0;
+            while (full < path.depth && path.nodes[path.depth - 1 - full]->count == internalSlots) {
+                full++;
+            }
+            // An inner node for every full ancestor, and a new root if they
+            // are all full
+            size_t needed = full + (full == path.depth ? 1 : 0);
+
+            Internal* spare[maxHeight + 1];
+            size_t allocated = 0;
+            Leaf* right = nullptr;
+
+            size_t mid = leafSlots / 2;
+            if (i == leafSlots && leaf == _last) {
+                mid = leafSlots;
+            } else if (i == 0 && leaf == _first) {
+                mid = 0;
+            }
+
+            try {
+                right = createLeaf();
+                for (; allocated < needed; allocated++) {
+                    spare[allocated] = createInternal();
+                }
+
+                // The separator is the first key of the right leaf once the
+                // new element is in. The element only starts the right leaf
+                // when it is appended to an otherwise empty one
+                Key separator(mid < leafSlots ? leaf->key(mid) : k);
+
+                relocateRange(right->slot(0), leaf->slot(mid), leafSlots - mid);
+                right->count = static_cast<unsigned short>(leafSlots - mid);
+                leaf->count = static_cast<unsigned short>(mid);
+
+                right->prev = leaf;
+                right->next = leaf->next;
+                if (leaf->next) {
+                    leaf->next->prev = right;
+                } else {
+                    _last = right;
+                }
+                leaf->next = right;
+
+                insertSeparatorHelper(path, std::move(separator), right, spare);
+            } catch (...) {
+                if (right) {
+                    freeNode(right);
+                }
+                for (size_t j = 0; j < allocated; j++) {
+                    freeNode(spare[j]);
+                }
+                throw;
+            }
+
+            if (i > mid || mid == leafSlots) {
+                leaf = right;
+                i -= mid;
+            }
+        }
+
+        // Adds separator with child right just after the child the path took
+        // in its last node, splitting full nodes upwards with the preallocated
+        // spare nodes. Nothing in here allocates or throws for keys whose
+        // move constructor does not
+        void insertSeparatorHelper(Path& path, Key&& separator, Node* right, Internal** spare) {
+            Key up(std::move(separator));
+
+            while (path.depth > 0) {
+                Internal* node = path.nodes[path.depth - 1];
+                size_t pos = path.index[path.depth - 1];
+                path.depth--;
+
+                if (node->count < internalSlots) {
+                    insertIntoInternal(node, pos, std::move(up), right);
+                    return;
+                }
+
+                // Split at mid: keys [0, mid) stay, key mid moves up and the
+                // rest go to a new node. The new key then goes to whichever
+                // half it belongs in, both of which have room
+                Internal* sibling = *spare++;
+                size_t mid = internalSlots / 2;
+
+                relocateRange(sibling->keys(), node->keys() + mid + 1, internalSlots - mid - 1);
+                for (size_t j = mid + 1; j <= internalSlots; j++) {
+                    sibling->children[j - mid - 1] = node->children[j];
+                }
+                sibling->count = static_cast<unsigned short>(internalSlots - mid - 1);
+
+                Key middle(std::move(node->key(mid)));
+                node->key(mid).~Key();
+                node->count = static_cast<unsigned short>(mid);
+
+                if (pos <= mid) {
+                    insertIntoInternal(node, pos, std::move(up), right);
+                } else {
+                    insertIntoInternal(sibling, pos - mid - 1, std::move(up), right);
+                }
+
+                up = std::move(middle);
+                right = sibling;
+            }
+
+            // Every node on the path was split, so the tree grows a level
+            Internal* root = *spare;
+            ::new (static_cast<void*>(root->keys())) Key(std::move(up));
+            root->children[0] = _root;
+            root->children[1] = right;
+            root->count = 1;
+            _root = root;
+        }
+
+        // Inserts key at pos of node, which has room, with child right after it
+        static void insertIntoInternal(Internal* node, size_t pos, Key&& key, Node* right) {
+            relocateRange(node->keys() + pos + 1, node->keys() + pos, node->count - pos);
+            ::new (static_cast<void*>(node->keys() + pos)) Key(std::move(key));
+
+            for (size_t j = node->count + 1; j > pos + 1; j--) {
+                node->children[j] = node->children[j - 1];
+            }
+            node->children[pos + 1] = right;
+            node->count++;
+        }
+
+        ///////////////////
+        // ERASE HELPERS //
+        ///////////////////
+
+        // Removes key pos and the child after it from node
+        static void removeFromInternal(Internal* node, size_t pos) {
+            node->key(pos).~Key();
+            relocateRange(node->keys() + pos, node->keys() + pos + 1, node->count - pos - 1);
+
+            for (size_t j = pos + 1; j < node->count; j++) {
+                node->children[j] = node->children[j + 1];
+            }
+            node->count--;
+        }
+
+        void unlinkLeaf(Leaf* leaf) {
+            if (leaf->prev) {
+                leaf->prev->next = leaf->next;
+            } else {
+                _first = leaf->next;
+            }
+
+            if (leaf->next) {
+                leaf->next->prev = leaf->prev;
+            } else {
+                _last = leaf->prev;
+            }
+        }
+
+        // Helper function for erase. Removes the element at position i of
+        // leaf, which path leads to, and refills the leaf from a sibling if it
+        // gets too small. Returns an iterator to the element after it
+        iterator eraseHelper(Path& path, Leaf* leaf, size_t i) {
+            leaf->slot(i)->~slot_type();
+            relocateRange(leaf->slot(i), leaf->slot(i + 1), leaf->count - i - 1);
+            leaf->count--;
+            _size--;
+
+            if (path.depth == 0) {
+                if (leaf->count == 0) {
+                    freeNode(leaf);
+                    _root = _first = _last = nullptr;
+                    return iterator();
+                }
+                return iteratorAt(leaf, i);
+            }
+
+            if (leaf->count >= minLeaf) {
+                return iteratorAt(leaf, i);
+            }
+
+            Internal* parent = path.nodes[path.depth - 1];
+            size_t pos = path.index[path.depth - 1];
+
+            if (pos > 0) {
+                Leaf* left = static_cast<Leaf*>(parent->children[pos - 1]);
+
+                if (left->count > minLeaf) {
+                    // Take the last element of the left sibling
+                    relocateRange(leaf->slot(1), leaf->slot(0), leaf->count);
+                    relocate(leaf->slot(0), left->slot(left->count - 1));
+                    left->count--;
+                    leaf->count++;
+                    parent->key(pos - 1) = leaf->key(0);
+                    return iteratorAt(leaf, i + 1);
+                }
+
+                // Merge into the left sibling
+                size_t offset = left->count;
+                relocateRange(left->slot(offset), leaf->slot(0), leaf->count);
+                left->count = static_cast<unsigned short>(left->count + leaf->count);
+                unlinkLeaf(leaf);
+                freeNode(leaf);
+
+                path.depth--;
+                removeFromInternal(parent, pos - 1);
+                rebalanceInternalHelper(path, parent);
+                return iteratorAt(left, offset + i);
+            }
+
+            Leaf* right = static_cast<Leaf*>(parent->children[pos + 1]);
+
+            if (right->count > minLeaf) {
+                // Take the first element of the right sibling
+                relocate(leaf->slot(leaf->count), right->slot(0));
+                relocateRange(right->slot(0), right->slot(1), right->count - 1);
+                right->count--;
+                leaf->count++;
+                parent->key(pos) = right->key(0);
+                return iteratorAt(leaf, i);
+            }
+
+            // Merge the right sibling in
+            relocateRange(leaf->slot(leaf->count), right->slot(0), right->count);
+            leaf->count = static_cast<unsigned short>(leaf->count + right->count);
+            unlinkLeaf(right);
+            freeNode(right);
+
+            path.depth--;
+            removeFromInternal(parent, pos);
+            rebalanceInternalHelper(path, parent);
+            return iteratorAt(leaf, i);
+        }
+
+        // Refills node, an inner node that lost a key, from a sibling if it
+        // got too small, and continues upwards after a merge. path leads to
+        // node's parent
+        void rebalanceInternalHelper(Path& path, Internal* node) {
+            while (true) {
+                if (path.depth == 0) {
+                    // The root is dropped once it has a single child left
+                    if (node->count == 0) {
+                        _root = node->children[0];
+                        freeNode(node);
+                    }
+                    return;
+                }
+
+                if (node->count >= minInternal) {
+                    return;
+                }
+
+                Internal* parent = path.nodes[path.depth - 1];
+                size_t pos = path.index[path.depth - 1];
+
+                if (pos > 0) {
+                    Internal* left = static_cast<Internal*>(parent->children[pos - 1]);
+
+                    if (left->count > minInternal) {
+                        // Rotate through the parent: its key comes down to
+                        // the front of node and the left sibling's last key
+                        // goes up in its place
+                        relocateRange(node->keys() + 1, node->keys(), node->count);
+                        for (size_t j = node->count + 1; j > 0; j--) {
+                            node->children[j] = node->children[j - 1];
+                        }
+                        ::new (static_cast<void*>(node->keys())) Key(std::move(parent->key(pos - 1)));
+                        node->children[0] = left->children[left->count];
+                        node->count++;
+
+                        parent->key(pos - 1) = std::move(left->key(left->count - 1));
+                        left->key(left->count - 1).~Key();
+                        left->count--;
+                        return;
+                    }
+
+                    mergeInternal(parent, pos - 1, left, node);
+                    node = parent;
+                    path.depth--;
+                    continue;
+                }
+
+                Internal* right = static_cast<Internal*>(parent->children[pos + 1]);
+
+                if (right->count > minInternal) {
+                    ::new (static_cast<void*>(node->keys() + node->count)) Key(std::move(parent->key(pos)));
+                    node->children[node->count + 1] = right->children[0];
+                    node->count++;
+
+                    parent->key(pos) = std::move(right->key(0));
+                    right->key(0).~Key();
+                    relocateRange(right->keys(), right->keys() + 1, right->count - 1);
+                    for (size_t j = 0; j < right->count; j++) {
+                        right->children[j] = right->children[j + 1];
+                    }
+                    right->count--;
+                    return;
+                }
+
+                mergeInternal(parent, pos, node, right);
+                node = parent;
+                path.depth--;
+            }
+        }
+
+        // Moves the parent's key at pos and all of right into left, then
+        // removes right from the parent
+        void mergeInternal(Internal* parent, size_t pos, Internal* left, Internal* right) {
+            ::new (static_cast<void*>(left->keys() + left->count)) Key(std::move(parent->key(pos)));
+            relocateRange(left->keys() + left->count + 1, right->keys(), right->count);
+            for (size_t j = 0; j <= right->count; j++) {
+                left->children[left->count + 1 + j] = right->children[j];
+            }
+            left->count = static_cast<unsigned short>(left->count + 1 + right->count);
+
+            freeNode(right);
+            removeFromInternal(parent, pos);
+        }
+
+        //////////////////
+        // COPY HELPERS //
+        //////////////////
+
+        // Copies the subtree at src, linking its leaves after last
+        Node* copyHelper(const Node* src, Leaf*& last) {
+            if (src->leaf) {
+                const Leaf* from = static_cast<const Leaf*>(src);
+                Leaf* leaf = createLeaf();
+
+                try {
+                    for (; leaf->count < from->count; leaf->count++) {
+                        ::new (static_cast<void*>(leaf->slot(leaf->count))) slot_type(*from->slot(leaf->count));
+                    }
+                } catch (...) {
+                    deleteHelper(leaf);
+                    throw;
+                }
+
+                leaf->prev = last;
+                if (last) {
+                    last->next = leaf;
+                } else {
+                    _first = leaf;
+                }
+                last = leaf;
+                return leaf;
+            }
+
+            const Internal* from = static_cast<const Internal*>(src);
+            Internal* node = createInternal();
+            std::fill(node->children, node->children + internalSlots + 1, nullptr);
+
+            try {
+                for (; node->count < from->count; node->count++) {
+                    ::new (static_cast<void*>(node->keys() + node->count)) Key(from->key(node->count));
+                }
+                for (size_t j = 0; j <= from->count; j++) {
+                    node->children[j] = copyHelper(from->children[j], last);
+                }
+            } catch (...) {
+                deleteHelper(node);
+                throw;
+            }
+
+            return node;
+        }
+
+        void copyFrom(const BTreeMap& other) {
+            if (other._root == nullptr) {
+                return;
+            }
+
+            Leaf* last = nullptr;
+            try {
+                _root = copyHelper(other._root, last);
+            } catch (...) {
+                _first = nullptr;
+                throw;
+            }
+
+            if (last) {
+                last->next = nullptr;
+            }
+            _last = last;
+            _size = other._size;
+        }
+
+        void stealTree(BTreeMap& other) {
+            _root = other._root;
+            _first = other._first;
+            _last = other._last;
+            _size = other._size;
+            other._root = other._first = other._last = nullptr;
+            other._size = 0;
+        }
+
+    public:
+        BTreeMap(): _root(nullptr), _first(nullptr), _last(nullptr), _size(0) {}
+
+        explicit BTreeMap(const Allocator& alloc)
+         : _root(nullptr), _first(nullptr), _last(nullptr), _size(0), _leafAlloc(alloc), _internalAlloc(alloc) {}
+
+        template <class InputIter>
+        BTreeMap(InputIter first, InputIter last, const Allocator& alloc = Allocator()): BTreeMap(alloc) {
+            while (first != last) {
+                insert(*first);
+                first++;
+            }
+        }
+
+        BTreeMap(std::initializer_list<value_type> il, const Allocator& alloc = Allocator())
+         : BTreeMap(il.begin(), il.end(), alloc) {}
+
+        BTreeMap(const BTreeMap& other)
+         : _root(nullptr), _first(nullptr), _last(nullptr), _size(0), _comp(other._comp),
+           _leafAlloc(leaf_traits::select_on_container_copy_construction(other._leafAlloc)),
+           _internalAlloc(internal_traits::select_on_container_copy_construction(other._internalAlloc)) {
+            copyFrom(other);
+        }
+
+        BTreeMap(BTreeMap&& other)
+         : _root(nullptr), _first(nullptr), _last(nullptr), _size(0), _comp(other._comp),
+           _leafAlloc(std::move(other._leafAlloc)), _internalAlloc(std::move(other._internalAlloc)) {
+            stealTree(other);
+        }
+
+        ~BTreeMap() {
+            deleteHelper(_root);
+        }
+
+        BTreeMap& operator=(const BTreeMap& other) {
+            if (this == &other) {
+                return *this;
+            }
+
+            if constexpr (leaf_traits::propagate_on_container_copy_assignment::value) {
+                clear();
+                _leafAlloc = other._leafAlloc;
+                _internalAlloc = other._internalAlloc;
+            }
+
+            // The copy is made before the old tree is freed, so an exception
+            // leaves the map as it was
+            BTreeMap temp(get_allocator());
+            temp._comp = other._comp;
+            temp.copyFrom(other);
+
+            clear();
+            _comp = other._comp;
+            stealTree(temp);
+
+            return *this;
+        }
+
+        BTreeMap& operator=(BTreeMap&& other) {
+            if (this == &other) {
+                return *this;
+            }
+
+            clear();
+            _comp = other._comp;
+
+            if constexpr (leaf_traits::propagate_on_container_move_assignment::value) {
+                _leafAlloc = std::move(other._leafAlloc);
+                _internalAlloc = std::move(other._internalAlloc);
+                stealTree(other);
+            } else if (_leafAlloc == other._leafAlloc) {
+                stealTree(other);
+            } else {
+                // Our allocator cannot free other's nodes, so move the values
+                // into nodes of our own instead
+                for (iterator i = other.begin(); i != other.end(); i++) {
+                    insert(std::move(*i));
+                }
+                other.clear();
+            }
+
+            return *this;
+        }
+
+        BTreeMap& operator=(std::initializer_list<value_type> il) {
+            clear();
+            for (const value_type& v : il) {
+                insert(v);
+            }
+
+            return *this;
+        }
+
+        // ITERATOR FUNCTIONS
+        iterator begin() noexcept { return iterator(_first, 0); }
+        const_iterator begin() const noexcept { return const_iterator(_first, 0); }
+        iterator end() noexcept { return end_(); }
+        const_iterator end() const noexcept { return end_(); }
+        reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+        reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+        const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+        const_iterator cbegin() const noexcept { return begin(); }
+        const_iterator cend() const noexcept { return end(); }
+        const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+        const_reverse_iterator crend() const noexcept { return rend(); }
+
+        // CAPACITY FUNCTIONS
+        bool empty() const noexcept { return _size == 0; }
+        size_t size() const noexcept { return _size; }
+
+        // ELEMENT ACCESS FUNCTIONS
+        mapped_type& operator[] (const key_type& k) {
+            return try_emplace(k).first->second;
+        }
+
+        mapped_type& operator[] (key_type&& k) {
+            return try_emplace(std::move(k)).first->second;
+        }
+
+        mapped_type& at (const key_type& k) {
+            iterator i = findHelper(k);
+
+            if (i == end()) {
+                throw std::out_of_range("Given key is not in map");
+            }
+
+            return i->second;
+        }
+
+        const mapped_type& at (const key_type& k) const {
+            const_iterator i = findHelper(k);
+
+            if (i == end()) {
+                throw std::out_of_range("Given key is not in map");
+            }
+
+            return i->second;
+        }
+
+        // MODIFIER FUNCTIONS
+        // Like Map, insert assigns the value when the key already exists
+        std::pair<iterator,bool> insert (const value_type& val) {
+            return insert_or_assign(val.first, val.second);
+        }
+
+        std::pair<iterator,bool> insert (value_type&& val) {
+            return insert_or_assign(val.first, std::move(val.second));
+        }
+
+        // Hints are accepted for compatibility with Map. Inserting past the
+        // end is already cheap, since it fills the last leaf completely
+        iterator insert (const_iterator, const value_type& val) {
+            return insert(val).first;
+        }
+
+        iterator insert (const_iterator, value_type&& val) {
+            return insert(std::move(val)).first;
+        }
+
+        // Constructs the element first to learn its key. If the key already
+        // exists, it is destroyed again and nothing is changed
+        template<class... Args>
+        std::pair<iterator,bool> emplace (Args&&... args) {
+            PendingSlot element;
+            ::new (static_cast<void*>(element.get())) slot_type(std::forward<Args>(args)...);
+            element.live = true;
+
+            return insertHelper(element.get()->first, [&element](void* p) {
+                ::new (p) slot_type(std::move(*element.get()));
+            });
+        }
+
+        template<class... Args>
+        iterator emplace_hint (const_iterator, Args&&... args) {
+            return emplace(std::forward<Args>(args)...).first;
+        }
+
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (const key_type& k, Args&&... args) {
+            return insertHelper(k, [&](void* p) {
+                ::new (p) slot_type(std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple(std::forward<Args>(args)...));
+            });
+        }
+
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (key_type&& k, Args&&... args) {
+            return insertHelper(k, [&](void* p) {
+                ::new (p) slot_type(std::piecewise_construct, std::forward_as_tuple(std::move(k)), std::forward_as_tuple(std::forward<Args>(args)...));
+            });
+        }
+
+        template<class... Args>
+        iterator try_emplace (const_iterator, const key_type& k, Args&&... args) {
+            return try_emplace(k, std::forward<Args>(args)...).first;
+        }
+
+        template<class... Args>
+        iterator try_emplace (const_iterator, key_type&& k, Args&&... args) {
+            return try_emplace(std::move(k), std::forward<Args>(args)...).first;
+        }
+
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (const key_type& k, M&& obj) {
+            std::pair<iterator, bool> result = try_emplace(k, std::forward<M>(obj));
+            if (!result.second) {
+                result.first->second = std::forward<M>(obj);
+            }
+
+            return result;
+        }
+
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (key_type&& k, M&& obj) {
+            std::pair<iterator, bool> result = try_emplace(std::move(k), std::forward<M>(obj));
+            if (!result.second) {
+                result.first->second = std::forward<M>(obj);
+            }
+
+            return result;
+        }
+
+        template<class M>
+        iterator insert_or_assign (const_iterator, const key_type& k, M&& obj) {
+            return insert_or_assign(k, std::forward<M>(obj)).first;
+        }
+
+        template<class M>
+        iterator insert_or_assign (const_iterator, key_type&& k, M&& obj) {
+            return insert_or_assign(std::move(k), std::forward<M>(obj)).first;
+        }
+
+        // The search from the root finds the path the rebalancing needs
+        iterator erase(const_iterator pos) {
+            Path path;
+            Leaf* leaf = descendHelper(pos->first, &path);
+
+            return eraseHelper(path, leaf, pos.index);
+        }
+
+        iterator erase(iterator pos) {
+            return erase(const_iterator(pos));
+        }
+
+        size_t erase(const key_type& k) {
+            if (_root == nullptr) {
+                return 0;
+            }
+
+            Path path;
+            Leaf* leaf = descendHelper(k, &path);
+            size_t i = leafLower(leaf, k);
+
+            if (i == leaf->count || _comp(k, leaf->key(i))) {
+                return 0;
+            }
+
+            eraseHelper(path, leaf, i);
+            return 1;
+        }
+
+        // Elements move as they are erased, so last cannot be compared
+        // against. The range is counted first and that many are erased
+        iterator erase(const_iterator first, const_iterator last) {
+            size_t n = 0;
+            for (const_iterator i = first; i != last; i++) {
+                n++;
+            }
+
+            iterator next(first.leaf, first.index);
+            while (n-- > 0) {
+                next = erase(const_iterator(next));
+            }
+
+            return next;
+        }
+
+        void swap(BTreeMap& x) {
+            std::swap(_root, x._root);
+            std::swap(_first, x._first);
+            std::swap(_last, x._last);
+            std::swap(_size, x._size);
+            std::swap(_comp, x._comp);
+            std::swap(_leafAlloc, x._leafAlloc);
+            std::swap(_internalAlloc, x._internalAlloc);
+        }
+
+        void clear() {
+            deleteHelper(_root);
+            _root = _first = _last = nullptr;
+            _size = 0;
+        }
+
+        // OBSERVER FUNCTIONS
+        key_compare key_comp() const { return _comp; }
+        allocator_type get_allocator() const { return allocator_type(_leafAlloc); }
+
+        // OPERATION FUNCTIONS
+        // The overloads taking a K are only available when Compare declares
+        // is_transparent, as in Map
+        iterator find(const key_type& k) {
+            return findHelper(k);
+        }
+
+        const_iterator find(const key_type& k) const {
+            return findHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator find(const K& k) {
+            return findHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator find(const K& k) const {
+            return findHelper(k);
+        }
+
+        size_t count(const key_type& k) const {
+            return findHelper(k) != end() ? 1 : 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t count(const K& k) const {
+            return findHelper(k) != end() ? 1 : 0;
+        }
+
+        iterator lower_bound(const key_type& k) {
+            return lowerBoundHelper(k);
+        }
+
+        const_iterator lower_bound(const key_type& k) const {
+            return lowerBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator lower_bound(const K& k) {
+            return lowerBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator lower_bound(const K& k) const {
+            return lowerBoundHelper(k);
+        }
+
+        iterator upper_bound(const key_type& k) {
+            return upperBoundHelper(k);
+        }
+
+        const_iterator upper_bound(const key_type& k) const {
+            return upperBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator upper_bound(const K& k) {
+            return upperBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator upper_bound(const K& k) const {
+            return upperBoundHelper(k);
+        }
+
+        std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const {
+            const_iterator lower = lowerBoundHelper(k);
+
+            if (lower != end() && !_comp(k, lower->first)) {
+                const_iterator upper = lower;
+                return std::pair<const_iterator, const_iterator>(lower, ++upper);
+            }
+
+            return std::pair<const_iterator, const_iterator>(lower, lower);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::pair<const_iterator, const_iterator> equal_range(const K& k) const {
+            const_iterator lower = lowerBoundHelper(k);
+
+            if (lower != end() && !_comp(k, lower->first)) {
+                const_iterator upper = lower;
+                return std::pair<const_iterator, const_iterator>(lower, ++upper);
+            }
+
+            return std::pair<const_iterator, const_iterator>(lower, lower);
+        }
+};
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef CONCURRENT_MAP_H
+#define CONCURRENT_MAP_H
+
+#include "Map.h"
+#include <algorithm>        // std::stable_sort
+#include <mutex>            // std::unique_lock
+#include <optional>         // std::optional
+#include <shared_mutex>     // std::shared_mutex, std::shared_lock
+#include <utility>          // std::move, std::forward
+#include <vector>           // std::vector
+
+// Map shared between threads. Any number of readers run at the same time
+// under a shared lock, while a writer holds the lock exclusively.
+//
+// Lookups return copies, since a reference into the tree would outlive the
+// lock that protects it. Scans and read() run a callback over the tree under
+// a single shared lock, so they see one consistent state. Writes that come
+// in groups go through a batch, which takes the exclusive lock once
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>, class Augment = NoAugment>
+class ConcurrentMap {
+    public:
+        using map_type       = Map<Key, T, Compare, Allocator, Augment>;
+        using key_type       = Key;
+        using mapped_type    = T;
+        using value_type     = std::pair<const Key, T>;
+        using key_compare    = Compare;
+        using allocator_type = Allocator;
+
+        // Writes recorded without holding any lock, then applied together
+        // by apply_batch(). Writes to the same key are applied in the order
+        // they were recorded
+        class batch {
+            public:
+                template<class M>
+                void insert_or_assign(const key_type& k, M&& obj) {
+                    _ops.push_back(Op{k, std::optional<T>(std::forward<M>(obj))});
+                }
+
+                template<class M>
+                void insert_or_assign(key_type&& k, M&& obj) {
+                    _ops.push_back(Op{std::move(k), std::optional<T>(std::forward<M>(obj))});
+                }
+
+                void erase(const key_type& k) {
+                    _ops.push_back(Op{k, std::nullopt});
+                }
+
+                void erase(key_type&& k) {
+                    _ops.push_back(Op{std::move(k), std::nullopt});
+                }
+
+                void reserve(size_t n) { _ops.reserve(n); }
+                size_t size() const noexcept { return _ops.size(); }
+                bool empty() const noexcept { return _ops.empty(); }
+                void clear() noexcept { _ops.clear(); }
+
+            private:
+                friend class ConcurrentMap;
+
+                // An erase when value is empty
+                struct Op {
+                    Key key;
+                    std::optional<T> value;
+                };
+
+                std::vector<Op> _ops;
+        };
+
+        ConcurrentMap(): _map(), _comp(_map.key_comp()) {}
+        explicit ConcurrentMap(const Allocator& alloc): _map(alloc), _comp(_map.key_comp()) {}
+        explicit ConcurrentMap(const map_type& m): _map(m), _comp(_map.key_comp()) {}
+        explicit ConcurrentMap(map_type&& m): _map(std::move(m)), _comp(_map.key_comp()) {}
+        ConcurrentMap(std::initializer_list<value_type> il): _map(il), _comp(_map.key_comp()) {}
+
+        // The mutex cannot be shared or moved, and copying a map that other
+        // threads are writing to needs a lock, so use snapshot() instead
+        ConcurrentMap(const ConcurrentMap&) = delete;
+        ConcurrentMap& operator=(const ConcurrentMap&) = delete;
+
+        // CAPACITY FUNCTIONS
+        size_t size() const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.size();
+        }
+
+        bool empty() const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.empty();
+        }
+
+        // LOOKUP FUNCTIONS
+        // The overloads taking a K are only available when Compare declares
+        // is_transparent, as in Map
+        std::optional<T> find(const key_type& k) const {
+            return findHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::optional<T> find(const K& k) const {
+            return findHelper(k);
+        }
+
+        bool contains(const key_type& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.count(k) != 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        bool contains(const K& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.count(k) != 0;
+        }
+
+        // Throws std::out_of_range if the key doesn't exist
+        T at(const key_type& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.at(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        T at(const K& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map.at(k);
+        }
+
+        // First element whose key is not less than k, if any
+        std::optional<value_type> lower_bound(const key_type& k) const {
+            return lowerBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::optional<value_type> lower_bound(const K& k) const {
+            return lowerBoundHelper(k);
+        }
+
+        // Calls f(const value_type&) on every element with lo <= key < hi,
+        // in key order, under one shared lock. f must not call back into
+        // this map, or a waiting writer can deadlock it
+        template<class F>
+        void scan(const key_type& lo, const key_type& hi, F f) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+
+            for (auto i = _map.lower_bound(lo); i != _map.end() && _comp(i->first, hi); i++) {
+                f(*i);
+            }
+        }
+
+        // Calls f(const value_type&) on every element under one shared lock
+        template<class F>
+        void for_each(F f) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+
+            for (const value_type& v : _map) {
+                f(v);
+            }
+        }
+
+        // Returns f(const map_type&), called under one shared lock, for reads
+        // that need several lookups to agree with each other. f must not keep
+        // references or iterators into the map
+        template<class F>
+        decltype(auto) read(F&& f) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return std::forward<F>(f)(static_cast<const map_type&>(_map));
+        }
+
+        // Copy of the whole map as of one point in time
+        map_type snapshot() const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _map;
+        }
+
+        // MODIFIER FUNCTIONS
+        // Returns true if k was inserted, false if its value was assigned
+        template<class M>
+        bool insert_or_assign(const key_type& k, M&& obj) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            return _map.insert_or_assign(k, std::forward<M>(obj)).second;
+        }
+
+        template<class M>
+        bool insert_or_assign(key_type&& k, M&& obj) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            return _map.insert_or_assign(std::move(k), std::forward<M>(obj)).second;
+        }
+
+        // Returns true if k was inserted, false if it already existed
+        template<class... Args>
+        bool try_emplace(const key_type& k, Args&&... args) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            return _map.try_emplace(k, std::forward<Args>(args)...).second;
+        }
+
+        size_t erase(const key_type& k) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            return _map.erase(k);
+        }
+
+        void clear() {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            _map.clear();
+        }
+
+        // Applies every write of b under one exclusive lock. The writes are
+        // sorted by key before the lock is taken, so that while it is held
+        // consecutive searches walk down mostly the same, cached, path
+        void apply_batch(batch b) {
+            std::stable_sort(b._ops.begin(), b._ops.end(), [this](const typename batch::Op& x, const typename batch::Op& y) {
+                return _comp(x.key, y.key);
+            });
+
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            applyBatchHelper(b._ops);
+        }
+
+        // Returns f(map_type&), called under the exclusive lock, for writes
+        // that depend on what is already in the map
+        template<class F>
+        decltype(auto) write(F&& f) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            return std::forward<F>(f)(_map);
+        }
+
+    private:
+        template<class K>
+        std::optional<T> findHelper(const K& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+
+            auto i = _map.find(k);
+            if (i == _map.end()) {
+                return std::nullopt;
+            }
+
+            return i->second;
+        }
+
+        template<class K>
+        std::optional<value_type> lowerBoundHelper(const K& k) const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+
+            auto i = _map.lower_bound(k);
+            if (i == _map.end()) {
+                return std::nullopt;
+            }
+
+            return *i;
+        }
+
+        // Helper function for apply_batch. Expects ops sorted by key and the
+        // exclusive lock held
+        void applyBatchHelper(std::vector<typename batch::Op>& ops) {
+            for (typename batch::Op& op : ops) {
+                if (op.value) {
+                    _map.insert_or_assign(std::move(op.key), std::move(*op.value));
+                } else {
+                    _map.erase(op.key);
+                }
+            }
+        }
+
+        map_type _map;
+        Compare _comp;      // Copy of the map's comparator, for sorting batches outside the lock
+        mutable std::shared_mutex _mutex;
+};
+
+#endif
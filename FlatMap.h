@@ -0,0 +1,710 @@
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include "Map.h"
+#include <algorithm>        // std::stable_sort
+#include <cstddef>          // size_t, ptrdiff_t
+#include <functional>       // std::less
+#include <initializer_list> // initializer_list
+#include <iterator>         // random access iterator tag
+#include <memory>           // std::allocator, std::allocator_traits
+#include <stdexcept>        // std::out_of_range
+#include <type_traits>      // std::conditional, std::is_nothrow_move_constructible
+#include <utility>          // std::move, std::move_if_noexcept, std::pair
+#include <vector>           // std::vector
+
+// Ordered map stored as two sorted arrays, one of keys and one of values.
+// For tables that are built once and then mostly read, this avoids a heap
+// allocation per element, and lookups binary search a contiguous key array
+// instead of following pointers.
+//
+// The API follows Map. Since the keys and values are stored apart, the
+// iterators return a pair of references, std::pair<const Key&, T&>, instead of
+// a reference to a std::pair. Inserting or erasing one element moves every
+// element after it, so build large tables with the range insert, which sorts
+// the new elements and merges them in with one pass. Any insert or erase
+// invalidates all iterators, pointers and references into the map
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>>
+class FlatMap {
+    static_assert(!std::is_same<T, bool>::value, "FlatMap needs addressable values, which std::vector<bool> does not have");
+
+    private:
+        // Random access iterator
+        template<bool Const>
+        class Flat_iterator;
+
+    public:
+        using key_type               = Key;
+        using mapped_type            = T;
+        using value_type             = std::pair<const Key, T>;
+        using key_compare            = Compare;
+        using allocator_type         = Allocator;
+
+        using reference              = std::pair<const Key&, T&>;
+        using const_reference        = std::pair<const Key&, const T&>;
+
+        using iterator               = Flat_iterator<false>;
+        using const_iterator         = Flat_iterator<true>;
+        using reverse_iterator       = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+        using key_container_type     = std::vector<Key, typename std::allocator_traits<Allocator>::template rebind_alloc<Key>>;
+        using mapped_container_type  = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+    private:
+        template<bool Const>
+        class Flat_iterator {
+            public:
+                using iterator_category     = std::random_access_iterator_tag;
+                using difference_type       = ptrdiff_t;
+
+                using value_type            = std::pair<const Key, T>;
+                using reference             = typename std::conditional<Const, const_reference, FlatMap::reference>::type;
+
+                // operator-> returns the pair of references by value, wrapped
+                // so that it->second works
+                struct pointer {
+                    reference ref;
+                    const reference* operator->() const noexcept { return &ref; }
+                };
+
+                using _Self                 = Flat_iterator<Const>;
+
+            private:
+                friend class FlatMap<Key, T, Compare, Allocator>;
+                template<bool _C>
+                friend class Flat_iterator;
+
+                using mapped_pointer = typename std::conditional<Const, const T*, T*>::type;
+
+                const Key* k;
+                mapped_pointer v;
+
+                Flat_iterator(const Key* key, mapped_pointer value) noexcept: k{key}, v{value} {}
+
+            public:
+                Flat_iterator() noexcept: k{nullptr}, v{nullptr} {}
+                // Converts an iterator into a const_iterator
+                template<bool _C, typename = typename std::enable_if<Const && !_C>::type>
+                Flat_iterator(const Flat_iterator<_C>& other) noexcept: k{other.k}, v{other.v} {}
+
+                reference operator*() const { return reference(*k, *v); }
+                pointer operator->() const { return pointer{reference(*k, *v)}; }
+                reference operator[](difference_type n) const { return reference(k[n], v[n]); }
+
+                // Prefix Increment: ++a
+                _Self& operator++() { k++; v++; return *this; }
+                // Postfix Increment: a++
+                _Self operator++(int) { _Self temp(*this); ++(*this); return temp; }
+                // Prefix Decrement: --a
+                _Self& operator--() { k--; v--; return *this; }
+                // Postfix Decrement: a--
+                _Self operator--(int) { _Self temp(*this); --(*this); return temp; }
+
+                _Self& operator+=(difference_type n) { k += n; v += n; return *this; }
+                _Self& operator-=(difference_type n) { k -= n; v -= n; return *this; }
+                _Self operator+(difference_type n) const { return _Self(k + n, v + n); }
+                _Self operator-(difference_type n) const { return _Self(k - n, v - n); }
+                friend _Self operator+(difference_type n, const _Self& i) { return i + n; }
+
+                // Iterators and const_iterators compare with each other
+                template<bool _C>
+                difference_type operator-(const Flat_iterator<_C>& other) const noexcept { return k - other.k; }
+                template<bool _C>
+                bool operator==(const Flat_iterator<_C>& other) const noexcept { return k == other.k; }
+                template<bool _C>
+                bool operator!=(const Flat_iterator<_C>& other) const noexcept { return k != other.k; }
+                template<bool _C>
+                bool operator<(const Flat_iterator<_C>& other) const noexcept { return k < other.k; }
+                template<bool _C>
+                bool operator>(const Flat_iterator<_C>& other) const noexcept { return k > other.k; }
+                template<bool _C>
+                bool operator<=(const Flat_iterator<_C>& other) const noexcept { return k <= other.k; }
+                template<bool _C>
+                bool operator>=(const Flat_iterator<_C>& other) const noexcept { return k >= other.k; }
+        };
+
+        // Input iterator over the elements that moves the values out, for
+        // handing them to a Map
+        struct MovingIterator {
+            using iterator_category = std::input_iterator_tag;
+            using difference_type   = ptrdiff_t;
+            using value_type        = std::pair<const Key, T>;
+            using reference         = std::pair<const Key&, T&&>;
+            using pointer           = void;
+
+            const Key* k;
+            T* v;
+
+            reference operator*() const { return reference(*k, std::move(*v)); }
+            MovingIterator& operator++() { k++; v++; return *this; }
+            bool operator==(const MovingIterator& other) const noexcept { return k == other.k; }
+            bool operator!=(const MovingIterator& other) const noexcept { return k != other.k; }
+        };
+
+        using pair_vector = std::vector<std::pair<Key, T>, typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<Key, T>>>;
+
+        key_container_type _keys;
+        mapped_container_type _values;
+        Compare _comp;
+
+        //////////////////////
+        // HELPER FUNCTIONS //
+        //////////////////////
+
+        iterator iteratorAt(size_t i) { return iterator(_keys.data() + i, _values.data() + i); }
+        const_iterator iteratorAt(size_t i) const { return const_iterator(_keys.data() + i, _values.data() + i); }
+
+        // Branchless binary search for the number of keys for which
+        // before(key) holds. The halving compiles to conditional moves, so
+        // a lookup in a large table has no mispredicted branches
+        template<typename Before>
+        size_t countBefore(Before before) const {
+            const Key* keys = _keys.data();
+            size_t n = _keys.size();
+
+            if (n == 0) {
+                return 0;
+            }
+
+            size_t base = 0;
+            while (n > 1) {
+                size_t half = n / 2;
+                base = before(keys[base + half]) ? base + half : base;
+                n -= half;
+            }
+
+            return base + (before(keys[base]) ? 1 : 0);
+        }
+
+        // Index of the first key not less than k
+        template<typename K>
+        size_t lowerIndex(const K& k) const {
+            return countBefore([this, &k](const Key& x) { return _comp(x, k); });
+        }
+
+        // Number of keys not greater than k
+        template<typename K>
+        size_t upperIndex(const K& k) const {
+            return countBefore([this, &k](const Key& x) { return !_comp(k, x); });
+        }
+
+        // Index of the key k, or size() if it doesn't exist
+        template<typename K>
+        size_t findIndex(const K& k) const {
+            size_t i = lowerIndex(k);
+
+            if (i < _keys.size() && !_comp(k, _keys[i])) {
+                return i;
+            }
+
+            return _keys.size();
+        }
+
+        // Index of the key k. Throws std::out_of_range if it doesn't exist
+        template<typename K>
+        size_t atIndex(const K& k) const {
+            size_t i = findIndex(k);
+
+            if (i == _keys.size()) {
+                throw std::out_of_range("Given key is not in map");
+            }
+
+            return i;
+        }
+
+        // Greatest element with a key not greater than k, like
+        // Map::upper_bound, or size() if there is none
+        template<typename K>
+        size_t floorIndex(const K& k) const {
+            size_t i = upperIndex(k);
+            return (i > 0) ? i - 1 : _keys.size();
+        }
+
+        // Helper function for every single element insert. Returns the index
+        // of k and false if it exists. Otherwise inserts KeyArg k and a value
+        // constructed from args at its place, and returns it with true
+        template<typename KeyArg, typename... Args>
+        std::pair<size_t, bool> insertHelper(KeyArg&& k, Args&&... args) {
+            size_t i = lowerIndex(k);
+
+            if (i < _keys.size() && !_comp(k, _keys[i])) {
+                return std::pair<size_t, bool>(i, false);
+            }
+
+            _keys.insert(_keys.begin() + i, std::forward<KeyArg>(k));
+            try {
+                _values.emplace(_values.begin() + i, std::forward<Args>(args)...);
+            } catch (...) {
+                _keys.erase(_keys.begin() + i);
+                throw;
+            }
+
+            return std::pair<size_t, bool>(i, true);
+        }
+
+        // Helper function for the range insert. Takes the new elements sorted
+        // by key, where a repeated key keeps the element added last, as
+        // insert does. New elements that all come after the current ones are
+        // appended in place. Otherwise both are merged into new arrays, so
+        // the map is unchanged if an exception is thrown (unless Key or T
+        // can only be moved, and its move can throw)
+        void mergeHelper(pair_vector& added) {
+            if (added.empty()) {
+                return;
+            }
+
+            auto lastOfRun = [this, &added](size_t j) {
+                return j + 1 == added.size() || _comp(added[j].first, added[j + 1].first);
+            };
+
+            if (_keys.empty() || _comp(_keys.back(), added.front().first)) {
+                size_t oldSize = _keys.size();
+
+                try {
+                    _keys.reserve(oldSize + added.size());
+                    _values.reserve(oldSize + added.size());
+
+                    for (size_t j = 0; j < added.size(); j++) {
+                        if (lastOfRun(j)) {
+                            _keys.push_back(std::move(added[j].first));
+                            _values.push_back(std::move(added[j].second));
+                        }
+                    }
+                } catch (...) {
+                    _keys.erase(_keys.begin() + oldSize, _keys.end());
+                    _values.erase(_values.begin() + std::min(_values.size(), oldSize), _values.end());
+                    throw;
+                }
+
+                return;
+            }
+
+            // Where each new element goes is worked out first, so that the
+            // comparator has run before any current element is moved from.
+            // place[j] is twice the number of current elements ordered
+            // before added[j], plus one if it replaces the next one, or
+            // dropped if a later element with the same key replaces it
+            const size_t dropped = size_t(-1);
+            std::vector<size_t> place(added.size(), dropped);
+            size_t i = 0;
+            for (size_t j = 0; j < added.size(); j++) {
+                if (!lastOfRun(j)) {
+                    continue;
+                }
+
+                for (; i < _keys.size() && _comp(_keys[i], added[j].first); i++) {}
+                place[j] = 2 * i + (i < _keys.size() && !_comp(added[j].first, _keys[i]));
+            }
+
+            key_container_type keys(_keys.get_allocator());
+            mapped_container_type values(_values.get_allocator());
+            keys.reserve(_keys.size() + added.size());
+            values.reserve(_keys.size() + added.size());
+
+            // A key and its value are moved one after the other, so the
+            // current elements are only moved if neither move can throw.
+            // Otherwise a throwing value move could leave a key moved from
+            constexpr bool moveCurrent = (std::is_nothrow_move_constructible<Key>::value && std::is_nothrow_move_constructible<T>::value)
+                                      || !(std::is_copy_constructible<Key>::value && std::is_copy_constructible<T>::value);
+            auto takeCurrent = [&](size_t k) {
+                if constexpr (moveCurrent) {
+                    keys.push_back(std::move(_keys[k]));
+                    values.push_back(std::move(_values[k]));
+                } else {
+                    keys.push_back(_keys[k]);
+                    values.push_back(_values[k]);
+                }
+            };
+
+            i = 0;
+            for (size_t j = 0; j < added.size(); j++) {
+                if (place[j] == dropped) {
+                    continue;
+                }
+
+                for (; i < place[j] / 2; i++) {
+                    takeCurrent(i);
+                }
+
+                // An existing key gets the new value
+                i += place[j] % 2;
+
+                keys.push_back(std::move_if_noexcept(added[j].first));
+                values.push_back(std::move_if_noexcept(added[j].second));
+            }
+
+            for (; i < _keys.size(); i++) {
+                takeCurrent(i);
+            }
+
+            _keys.swap(keys);
+            _values.swap(values);
+        }
+
+    public:
+        FlatMap() = default;
+
+        explicit FlatMap(const Allocator& alloc): _keys(alloc), _values(alloc) {}
+
+        template <class InputIter>
+        FlatMap(InputIter first, InputIter last, const Allocator& alloc = Allocator()): FlatMap(alloc) {
+            insert(first, last);
+        }
+
+        // Builds the map in O(n) from a range sorted by unique keys. The
+        // range is trusted to be sorted
+        template <class InputIter>
+        FlatMap(sorted_unique_t, InputIter first, InputIter last, const Allocator& alloc = Allocator()): FlatMap(alloc) {
+            for (; first != last; ++first) {
+                _keys.push_back((*first).first);
+                _values.push_back((*first).second);
+            }
+        }
+
+        FlatMap(std::initializer_list<value_type> il, const Allocator& alloc = Allocator())
+         : FlatMap(il.begin(), il.end(), alloc) {}
+
+        // Copies a Map in O(n), since its elements are already in order
+        template<class MapAllocator, class Augment>
+        explicit FlatMap(const Map<Key, T, Compare, MapAllocator, Augment>& m, const Allocator& alloc = Allocator())
+         : _keys(alloc), _values(alloc), _comp(m.key_comp()) {
+            _keys.reserve(m.size());
+            _values.reserve(m.size());
+
+            for (const auto& v : m) {
+                _keys.push_back(v.first);
+                _values.push_back(v.second);
+            }
+        }
+
+        // Like the Map copy, but moves the values out and leaves m empty
+        template<class MapAllocator, class Augment>
+        explicit FlatMap(Map<Key, T, Compare, MapAllocator, Augment>&& m, const Allocator& alloc = Allocator())
+         : _keys(alloc), _values(alloc), _comp(m.key_comp()) {
+            _keys.reserve(m.size());
+            _values.reserve(m.size());
+
+            for (auto& v : m) {
+                _keys.push_back(v.first);
+                _values.push_back(std::move(v.second));
+            }
+            m.clear();
+        }
+
+        FlatMap& operator=(std::initializer_list<value_type> il) {
+            clear();
+            insert(il.begin(), il.end());
+            return *this;
+        }
+
+        // Builds a Map in O(n) with Map's sorted_unique constructor
+        template<class MapType = Map<Key, T, Compare, Allocator>>
+        MapType to_map() const & {
+            return MapType(sorted_unique, begin(), end());
+        }
+
+        // Like the const to_map, but moves the values out and leaves this
+        // map empty
+        template<class MapType = Map<Key, T, Compare, Allocator>>
+        MapType to_map() && {
+            MapType m(sorted_unique, MovingIterator{_keys.data(), _values.data()},
+                      MovingIterator{_keys.data() + _keys.size(), _values.data() + _values.size()});
+            clear();
+            return m;
+        }
+
+        // ITERATOR FUNCTIONS
+        iterator begin() noexcept { return iteratorAt(0); }
+        const_iterator begin() const noexcept { return iteratorAt(0); }
+        iterator end() noexcept { return iteratorAt(_keys.size()); }
+        const_iterator end() const noexcept { return iteratorAt(_keys.size()); }
+        reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+        reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+        const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+        const_iterator cbegin() const noexcept { return begin(); }
+        const_iterator cend() const noexcept { return end(); }
+        const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+        const_reverse_iterator crend() const noexcept { return rend(); }
+
+        // CAPACITY FUNCTIONS
+        bool empty() const noexcept { return _keys.empty(); }
+        size_t size() const noexcept { return _keys.size(); }
+        size_t capacity() const noexcept { return _keys.capacity(); }
+
+        void reserve(size_t n) {
+            _keys.reserve(n);
+            _values.reserve(n);
+        }
+
+        void shrink_to_fit() {
+            _keys.shrink_to_fit();
+            _values.shrink_to_fit();
+        }
+
+        // ELEMENT ACCESS FUNCTIONS
+        mapped_type& operator[] (const key_type& k) {
+            return _values[insertHelper(k).first];
+        }
+
+        mapped_type& operator[] (key_type&& k) {
+            return _values[insertHelper(std::move(k)).first];
+        }
+
+        mapped_type& at (const key_type& k) {
+            return _values[atIndex(k)];
+        }
+
+        const mapped_type& at (const key_type& k) const {
+            return _values[atIndex(k)];
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        mapped_type& at (const K& k) {
+            return _values[atIndex(k)];
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const mapped_type& at (const K& k) const {
+            return _values[atIndex(k)];
+        }
+
+        // The sorted keys and the values in the same order
+        const key_container_type& keys() const noexcept { return _keys; }
+        const mapped_container_type& values() const noexcept { return _values; }
+
+        // MODIFIER FUNCTIONS
+        // Like Map, insert assigns the value when the key already exists
+        std::pair<iterator,bool> insert (const value_type& val) {
+            return insert_or_assign(val.first, val.second);
+        }
+
+        std::pair<iterator,bool> insert (value_type&& val) {
+            return insert_or_assign(val.first, std::move(val.second));
+        }
+
+        // Hints are accepted for compatibility with Map
+        iterator insert (const_iterator, const value_type& val) {
+            return insert(val).first;
+        }
+
+        iterator insert (const_iterator, value_type&& val) {
+            return insert(std::move(val)).first;
+        }
+
+        // Inserts the elements of [first, last) in O(n + m log m) for m new
+        // elements: they are sorted, then merged with the current ones in
+        // one pass. Like insert, a repeated key keeps the last value. If an
+        // exception is thrown, the map is left as it was
+        template <class InputIter>
+        void insert(InputIter first, InputIter last) {
+            pair_vector added(_keys.get_allocator());
+            for (; first != last; ++first) {
+                added.emplace_back((*first).first, (*first).second);
+            }
+
+            std::stable_sort(added.begin(), added.end(), [this](const std::pair<Key, T>& x, const std::pair<Key, T>& y) {
+                return _comp(x.first, y.first);
+            });
+            mergeHelper(added);
+        }
+
+        void insert(std::initializer_list<value_type> il) {
+            insert(il.begin(), il.end());
+        }
+
+        // Constructs the element first to learn its key. If the key already
+        // exists, it is destroyed again and nothing is changed
+        template<class... Args>
+        std::pair<iterator,bool> emplace (Args&&... args) {
+            std::pair<Key, T> element(std::forward<Args>(args)...);
+            std::pair<size_t, bool> result = insertHelper(std::move(element.first), std::move(element.second));
+
+            return std::pair<iterator, bool>(iteratorAt(result.first), result.second);
+        }
+
+        template<class... Args>
+        iterator emplace_hint (const_iterator, Args&&... args) {
+            return emplace(std::forward<Args>(args)...).first;
+        }
+
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (const key_type& k, Args&&... args) {
+            std::pair<size_t, bool> result = insertHelper(k, std::forward<Args>(args)...);
+            return std::pair<iterator, bool>(iteratorAt(result.first), result.second);
+        }
+
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (key_type&& k, Args&&... args) {
+            std::pair<size_t, bool> result = insertHelper(std::move(k), std::forward<Args>(args)...);
+            return std::pair<iterator, bool>(iteratorAt(result.first), result.second);
+        }
+
+        template<class... Args>
+        iterator try_emplace (const_iterator, const key_type& k, Args&&... args) {
+            return try_emplace(k, std::forward<Args>(args)...).first;
+        }
+
+        template<class... Args>
+        iterator try_emplace (const_iterator, key_type&& k, Args&&... args) {
+            return try_emplace(std::move(k), std::forward<Args>(args)...).first;
+        }
+
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (const key_type& k, M&& obj) {
+            std::pair<size_t, bool> result = insertHelper(k, std::forward<M>(obj));
+            if (!result.second) {
+                _values[result.first] = std::forward<M>(obj);
+            }
+
+            return std::pair<iterator, bool>(iteratorAt(result.first), result.second);
+        }
+
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (key_type&& k, M&& obj) {
+            std::pair<size_t, bool> result = insertHelper(std::move(k), std::forward<M>(obj));
+            if (!result.second) {
+                _values[result.first] = std::forward<M>(obj);
+            }
+
+            return std::pair<iterator, bool>(iteratorAt(result.first), result.second);
+        }
+
+        template<class M>
+        iterator insert_or_assign (const_iterator, const key_type& k, M&& obj) {
+            return insert_or_assign(k, std::forward<M>(obj)).first;
+        }
+
+        template<class M>
+        iterator insert_or_assign (const_iterator, key_type&& k, M&& obj) {
+            return insert_or_assign(std::move(k), std::forward<M>(obj)).first;
+        }
+
+        iterator erase(const_iterator pos) {
+            return erase(pos, pos + 1);
+        }
+
+        iterator erase(iterator pos) {
+            return erase(const_iterator(pos));
+        }
+
+        size_t erase(const key_type& k) {
+            size_t i = findIndex(k);
+
+            if (i == _keys.size()) {
+                return 0;
+            }
+
+            erase(iteratorAt(i));
+            return 1;
+        }
+
+        iterator erase(const_iterator first, const_iterator last) {
+            size_t i = first - begin();
+            size_t j = last - begin();
+
+            _keys.erase(_keys.begin() + i, _keys.begin() + j);
+            _values.erase(_values.begin() + i, _values.begin() + j);
+
+            return iteratorAt(i);
+        }
+
+        void swap(FlatMap& x) {
+            _keys.swap(x._keys);
+            _values.swap(x._values);
+            std::swap(_comp, x._comp);
+        }
+
+        void clear() noexcept {
+            _keys.clear();
+            _values.clear();
+        }
+
+        // OBSERVER FUNCTIONS
+        key_compare key_comp() const { return _comp; }
+        allocator_type get_allocator() const { return allocator_type(_keys.get_allocator()); }
+
+        // OPERATION FUNCTIONS
+        // The overloads taking a K are only available when Compare declares
+        // is_transparent, as in Map
+        iterator find(const key_type& k) {
+            return iteratorAt(findIndex(k));
+        }
+
+        const_iterator find(const key_type& k) const {
+            return iteratorAt(findIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator find(const K& k) {
+            return iteratorAt(findIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator find(const K& k) const {
+            return iteratorAt(findIndex(k));
+        }
+
+        size_t count(const key_type& k) const {
+            return findIndex(k) != _keys.size() ? 1 : 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t count(const K& k) const {
+            return findIndex(k) != _keys.size() ? 1 : 0;
+        }
+
+        iterator lower_bound(const key_type& k) {
+            return iteratorAt(lowerIndex(k));
+        }
+
+        const_iterator lower_bound(const key_type& k) const {
+            return iteratorAt(lowerIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator lower_bound(const K& k) {
+            return iteratorAt(lowerIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator lower_bound(const K& k) const {
+            return iteratorAt(lowerIndex(k));
+        }
+
+        iterator upper_bound(const key_type& k) {
+            return iteratorAt(floorIndex(k));
+        }
+
+        const_iterator upper_bound(const key_type& k) const {
+            return iteratorAt(floorIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator upper_bound(const K& k) {
+            return iteratorAt(floorIndex(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator upper_bound(const K& k) const {
+            return iteratorAt(floorIndex(k));
+        }
+
+        std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const {
+            size_t i = lowerIndex(k);
+            size_t j = (i < _keys.size() && !_comp(k, _keys[i])) ? i + 1 : i;
+
+            return std::pair<const_iterator, const_iterator>(iteratorAt(i), iteratorAt(j));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::pair<const_iterator, const_iterator> equal_range(const K& k) const {
+            size_t i = lowerIndex(k);
+            size_t j = (i < _keys.size() && !_comp(k, _keys[i])) ? i + 1 : i;
+
+            return std::pair<const_iterator, const_iterator>(iteratorAt(i), iteratorAt(j));
+        }
+};
+
+#endif
@@ -1,19 +1,149 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include "ThreadPool.h"     // ThreadPool, parallel_policy
 #include <iostream>
 #include <functional>       // std::less
-#include <utility>          // std::move
+#include <utility>          // std::move, std::exchange
 #include <iterator>         // bidirectional iterator tag
-#include <tuple>            // std::pair
+#include <tuple>            // std::pair, std::forward_as_tuple
 #include <initializer_list> // initializer_list
+#include <memory>           // std::allocator, std::allocator_traits
+#include <type_traits>      // std::void_t, std::is_trivially_destructible
+#include <optional>         // std::optional
+#include <stdexcept>        // std::out_of_range, std::invalid_argument
+#include <limits>           // std::numeric_limits
+#include <cstdint>          // uintptr_t
+#include <algorithm>        // std::stable_sort, std::inplace_merge, std::min, std::lower_bound
+#include <vector>           // std::vector
+#if __cplusplus >= 202002L
+#include <compare>          // operator<=>, std::three_way_comparable_with
+#endif
+
+// Tag for constructing a Map from a range that is already sorted by key and
+// holds no duplicate keys, e.g. Map<K, T> m(sorted_unique, v.begin(), v.end())
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+
+inline constexpr sorted_unique_t sorted_unique{};
+
+// Augmentation policies for the Augment parameter of Map. Every tree node
+// inherits from the policy, and update() recomputes the node's policy data
+// from its value and the data of its children (nullptr for a missing child)
+// whenever the subtree below the node changes
+
+// Keeps no extra data. This is the default
+struct NoAugment {
+    template<typename Value>
+    void update(const Value&, const NoAugment*, const NoAugment*) {}
+};
+
+// Keeps the number of nodes in every subtree, which enables select(),
+// rank(), count_range() and iterator subtraction in O(log n)
+struct OrderStatistics {
+    size_t size = 1;
+
+    template<typename Value>
+    void update(const Value&, const OrderStatistics* left, const OrderStatistics* right) {
+        size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+    }
+};
+
+// Keeps the combination of the mapped values in every subtree under a
+// monoid, which enables aggregate(lo, hi) in O(log n). A monoid provides a
+// value_type, an identity() and an associative combine(a, b). Mapped values
+// are converted to value_type, and are combined in key order, so combine
+// does not need to be commutative
+template<typename Monoid>
+struct Aggregate {
+    using monoid_type = Monoid;
+
+    typename Monoid::value_type total = Monoid::identity();
+
+    template<typename Value>
+    void update(const Value& value, const Aggregate* left, const Aggregate* right) {
+        total = Monoid::combine(left ? left->total : Monoid::identity(), value.second);
+        if (right) {
+            total = Monoid::combine(total, right->total);
+        }
+    }
+};
+
+// Monoids for Aggregate
+template<typename V>
+struct SumMonoid {
+    using value_type = V;
+    static value_type identity() { return V(); }
+    static value_type combine(const value_type& a, const value_type& b) { return a + b; }
+};
+
+template<typename V>
+struct MinMonoid {
+    using value_type = V;
+    static value_type identity() { return std::numeric_limits<V>::max(); }
+    static value_type combine(const value_type& a, const value_type& b) { return b < a ? b : a; }
+};
+
+template<typename V>
+struct MaxMonoid {
+    using value_type = V;
+    static value_type identity() { return std::numeric_limits<V>::lowest(); }
+    static value_type combine(const value_type& a, const value_type& b) { return a < b ? b : a; }
+};
+
+// Three-way key comparison for tree searches. With std::less (or std::less<>)
+// as comparator, a search for a K can get a three-way result per node, which
+// also tells when the key is found, so it can stop early. Arithmetic keys
+// test equality first, the same shape the compiler gives <=> on integers.
+// Other keys need C++20 and a weak order from <=>, which then agrees with
+// operator< (pointers are left out, since std::less orders them even where
+// <=> does not)
+template<class Compare, class Key>
+struct ThreeWayCompare {
+    template<typename K>
+    static constexpr bool enabled() {
+        if constexpr (std::is_same<Compare, std::less<Key>>::value || std::is_same<Compare, std::less<>>::value) {
+            if constexpr (std::is_arithmetic<Key>::value && std::is_arithmetic<K>::value) {
+                return true;
+            }
+#ifdef __cpp_lib_three_way_comparison
+            if constexpr (!std::is_pointer<Key>::value) {
+                return std::three_way_comparable_with<K, Key, std::weak_ordering>;
+            }
+#endif
+        }
+        return false;
+    }
+
+    // Negative, zero or positive as x orders before, with or after key.
+    // Only called when enabled<K>() is true
+    template<typename K>
+    static int compare(const K& x, const Key& key) {
+        if constexpr (std::is_arithmetic<Key>::value && std::is_arithmetic<K>::value) {
+            return (x == key) ? 0 : ((x < key) ? -1 : 1);
+        } else {
+#ifdef __cpp_lib_three_way_comparison
+            auto order = x <=> key;
+            return (order < 0) ? -1 : (order > 0);
+#else
+            (void)x;
+            (void)key;
+            return 0;
+#endif
+        }
+    }
+};
 
-template<class Key, class T, class Compare = std::less<Key>>
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>, class Augment = NoAugment>
 class Map {
     private:
         // Color type to describe if a node is black or red
         enum class Color {Red, Black};
 
+        // Links and color of a tree node. The header is only this part
+        struct RB_Node_Base;
+
         // Node for Red-Black Tree
         struct RB_Node;
 
@@ -21,11 +151,15 @@ class Map {
         template<typename _Tp>
         class RB_tree_iterator;
 
+        // Owner of a node extracted from the tree
+        class RB_node_handle;
+
     public:
         using key_type               = Key;
         using mapped_type            = T;
         using value_type             = std::pair<const Key, T>;
         using key_compare            = Compare;
+        using allocator_type         = Allocator;
         
         using reference              = value_type&;
         using const_reference        = const value_type&;
@@ -37,22 +171,162 @@ class Map {
         using reverse_iterator       = std::reverse_iterator<iterator>;
         using const_reverse_iterator = std::reverse_iterator<const_iterator>;
 
+        using node_type              = RB_node_handle;
+
 
     private:
-        // Node for Red-Black Tree
-        struct RB_Node {
+        // Links and color of a tree node. A link may lead to the header,
+        // which is only an RB_Node_Base, so links are never RB_Node pointers
+        struct RB_Node_Base {
+            RB_Node_Base* left;
+            RB_Node_Base* right;
+
+            RB_Node_Base(): left{nullptr}, right{nullptr}, parentAndColor{0} {}
+
+            RB_Node_Base* parent() const {
+                return reinterpret_cast<RB_Node_Base*>(parentAndColor & ~uintptr_t(1));
+            }
+
+            void setParent(RB_Node_Base* p) {
+                parentAndColor = reinterpret_cast<uintptr_t>(p) | (parentAndColor & 1);
+            }
+
+            Color color() const {
+                return (parentAndColor & 1) ? Color::Black : Color::Red;
+            }
+
+            void setColor(Color c) {
+                parentAndColor = (parentAndColor & ~uintptr_t(1)) | (c == Color::Black ? 1 : 0);
+            }
+
+            private:
+                // The parent pointer with the color in its lowest bit, which
+                // is always zero in a node address. A set bit means black
+                uintptr_t parentAndColor;
+        };
+
+        // Node for Red-Black Tree. The Augment base holds the policy data
+        struct RB_Node : RB_Node_Base, Augment {
             using value_type = std::pair<const Key, T>;
 
             value_type value;
-            RB_Node* parent;
-            RB_Node* left;
-            RB_Node* right;
-            Color color;
 
-            RB_Node(value_type value = value_type(Key(), T()), RB_Node* parent = nullptr, RB_Node* left = nullptr, RB_Node* right = nullptr, Color color = Color::Red)
-             : value{value}, parent{parent}, left{left}, right{right}, color{color} {}
+            // Constructs the value in place from args. The node starts out
+            // unlinked and red
+            template<typename... Args>
+            explicit RB_Node(Args&&... args)
+             : RB_Node_Base(), Augment(), value(std::forward<Args>(args)...) {}
+        };
+
+        // Nodes are allocated through the user's allocator rebound to RB_Node
+        using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<RB_Node>;
+        using node_traits    = std::allocator_traits<node_allocator>;
+
+        // Detects allocators like PoolAllocator that can free every node they
+        // handed out in one release() call
+        template<typename A, typename = void>
+        struct has_release : std::false_type {};
+
+        template<typename A>
+        struct has_release<A, std::void_t<decltype(std::declval<A&>().release()), decltype(std::declval<const A&>().unique())>> : std::true_type {};
+
+        // Result type of aggregate(), which is void unless the Augment
+        // policy is an Aggregate
+        template<typename A, typename = void>
+        struct aggregate_value {
+            using type = void;
+        };
+
+        template<typename A>
+        struct aggregate_value<A, std::void_t<typename A::monoid_type>> {
+            using type = typename A::monoid_type::value_type;
+        };
+
+        // Node handle returned by extract(). It owns an RB_Node that is not
+        // linked into any tree, together with a copy of the allocator that
+        // made it, so the node can be handed to insert() of a map with an
+        // equal allocator without being reallocated or its value moved
+        class RB_node_handle {
+            public:
+                using key_type       = Key;
+                using mapped_type    = T;
+                using allocator_type = Allocator;
+
+                RB_node_handle() noexcept: _node(nullptr) {}
+
+                RB_node_handle(RB_node_handle&& other) noexcept: _node(other._node), _alloc(std::move(other._alloc)) {
+                    other._node = nullptr;
+                    other._alloc.reset();
+                }
+
+                RB_node_handle& operator=(RB_node_handle&& other) noexcept {
+                    if (this != &other) {
+                        reset();
+                        _node = other._node;
+                        _alloc = std::move(other._alloc);
+                        other._node = nullptr;
+                        other._alloc.reset();
+                    }
+
+                    return *this;
+                }
+
+                ~RB_node_handle() {
+                    reset();
+                }
+
+                bool empty() const noexcept { return _node == nullptr; }
+                explicit operator bool() const noexcept { return _node != nullptr; }
+
+                // The key may be changed before the node is inserted again
+                key_type& key() const { return const_cast<key_type&>(_node->value.first); }
+                mapped_type& mapped() const { return _node->value.second; }
+
+                allocator_type get_allocator() const { return allocator_type(*_alloc); }
+
+                void swap(RB_node_handle& other) noexcept {
+                    std::swap(_node, other._node);
+                    std::swap(_alloc, other._alloc);
+                }
+
+            private:
+                friend class Map<Key, T, Compare, Allocator, Augment>;
+
+                RB_node_handle(RB_Node* node, const node_allocator& alloc): _node(node), _alloc(alloc) {}
+
+                // Gives up ownership of the node
+                RB_Node* release() noexcept {
+                    RB_Node* node = _node;
+                    _node = nullptr;
+                    _alloc.reset();
+                    return node;
+                }
+
+                // Destroys the owned node, if any
+                void reset() noexcept {
+                    if (_node) {
+                        node_traits::destroy(*_alloc, _node);
+                        node_traits::deallocate(*_alloc, _node, 1);
+                        _node = nullptr;
+                    }
+                    _alloc.reset();
+                }
+
+                RB_Node* _node;
+                std::optional<node_allocator> _alloc;
         };
 
+    public:
+        // Result of inserting a node handle. If the key already existed, node
+        // still owns the node and position points to the existing element
+        struct insert_return_type {
+            iterator position;
+            bool inserted;
+            node_type node;
+        };
+
+    private:
+
         // Converts enum Color to a string
         std::string color_string(Color c) {
             switch(c) {
@@ -76,8 +350,12 @@ class Map {
                 using _Self                 = RB_tree_iterator<_Tp>;
 
             private:
-                friend class Map<Key, T, Compare>;
-                using Node = typename Map<Key, T, Compare>::RB_Node;
+                friend class Map<Key, T, Compare, Allocator, Augment>;
+                template<typename _Up>
+                friend class RB_tree_iterator;
+                // The iterator moves along links, so end() is the header
+                // itself and only a dereference casts to RB_Node
+                using Node = typename Map<Key, T, Compare, Allocator, Augment>::RB_Node_Base;
 
                 Node* n;
 
@@ -87,13 +365,16 @@ class Map {
             public:
                 RB_tree_iterator() { n = nullptr; };
                 RB_tree_iterator(const _Self&) = default;
+                // Converts an iterator into a const_iterator
+                template<typename _Up, typename = typename std::enable_if<std::is_same<const _Up, _Tp>::value && !std::is_same<_Up, _Tp>::value>::type>
+                RB_tree_iterator(const RB_tree_iterator<_Up>& other) noexcept: n{other.n} {}
                 RB_tree_iterator(_Self&&) = default;
                 ~RB_tree_iterator() = default;
                 _Self& operator=(const _Self&) = default;
                 _Self& operator=(_Self&&) = default;
 
-                reference operator*() const { return n->value; }
-                pointer operator->() const { return &(n->value); }
+                reference operator*() const { return Map::asNode(n)->value; }
+                pointer operator->() const { return &(Map::asNode(n)->value); }
 
                 // Prefix Increment: ++a
                 _Self& operator++() {
@@ -107,11 +388,11 @@ class Map {
                     } else {
                         // If there is no right, then go up until you find an unexplored right
                         // The ending node would be the next inorder successor
-                        Node* p = n->parent;
+                        Node* p = n->parent();
 
                         while (n == p->right) {
                             n = p;
-                            p = p->parent;
+                            p = p->parent();
                         }
 
                         if (n->right != p) {
@@ -130,7 +411,7 @@ class Map {
                 }
                 // Prefix Decrement: --a
                 _Self& operator--() {
-                    if ((n->parent->parent == n) && (n->color == Color::Red)) {
+                    if ((n->parent()->parent() == n) && (n->color() == Color::Red)) {
                         n = n->right;
                     } else if (n->left) {
                         // If there is a left, rightmost node in left subtree is predecessor
@@ -142,11 +423,11 @@ class Map {
                     } else {
                         // If there is no left, then go up until you find an unexplored left
                         // The ending node would be the next inorder predecessor
-                        Node* p = n->parent;
+                        Node* p = n->parent();
 
                         while (n == p->left) {
                             n = p;
-                            p = p->parent;
+                            p = p->parent();
                         }
 
                         if (n->left != p) {
@@ -167,6 +448,12 @@ class Map {
                 bool operator==(const _Self& other) const noexcept { return n == other.n; }
                 bool operator!=(const _Self& other) const noexcept { return n != other.n; }
 
+                // Number of elements from other to this iterator. Requires
+                // the OrderStatistics augment and takes O(log n)
+                difference_type operator-(const _Self& other) const {
+                    return difference_type(Map::nodeRank(n)) - difference_type(Map::nodeRank(other.n));
+                }
+
         };
 
 
@@ -189,8 +476,8 @@ class Map {
                 using _Self                 = RB_tree_const_iterator<_Tp>;
 
             private:
-                friend class Map<Key, T, Compare>;
-                using Node = typename Map<Key, T, Compare>::RB_Node;
+                friend class Map<Key, T, Compare, Allocator, Augment>;
+                using Node = typename Map<Key, T, Compare, Allocator, Augment>::RB_Node_Base;
 
                 Node* n;
 
@@ -207,10 +494,10 @@ class Map {
                 _Self& operator=(_Self&&) = default;
 
                 // Used to turn a const_iterator into an iterator 
-                iterator _const_cast() const noexcept { return iterator(const_cast<typename iterator::RB_Node*>(n)); }
+                iterator _const_cast() const noexcept { return iterator(n); }
 
-                reference operator*() const { return n->value; }
-                pointer operator->() const { return &(n->value); }
+                reference operator*() const { return Map::asNode(n)->value; }
+                pointer operator->() const { return &(Map::asNode(n)->value); }
 
                 // Prefix Increment: ++a
                 _Self& operator++() {
@@ -224,11 +511,11 @@ class Map {
                     } else {
                         // If there is no right, then go up until you find an unexplored right
                         // The ending node would be the next inorder successor
-                        Node* p = n->parent;
+                        Node* p = n->parent();
 
                         while (n == p->right) {
                             n = p;
-                            p = p->parent;
+                            p = p->parent();
                         }
 
                         if (n->right != p) {
@@ -247,7 +534,7 @@ class Map {
                 }
                 // Prefix Decrement: --a
                 _Self& operator--() {
-                    if ((n->parent->parent == n) && (n->color == Color::Red)) {
+                    if ((n->parent()->parent() == n) && (n->color() == Color::Red)) {
                         n = n->right;
                     } else if (n->left) {
                         // If there is a left, rightmost node in left subtree is predecessor
@@ -259,11 +546,11 @@ class Map {
                     } else {
                         // If there is no left, then go up until you find an unexplored left
                         // The ending node would be the next inorder predecessor
-                        Node* p = n->parent;
+                        Node* p = n->parent();
 
                         while (n == p->left) {
                             n = p;
-                            p = p->parent;
+                            p = p->parent();
                         }
 
                         if (n->left != p) {
@@ -302,13 +589,15 @@ class Map {
         // Member variables //
         //////////////////////
     
-        // _head.parent = root
+        // _head.parent() = root
         // _head.left = minimum
         // _head.right = maximum
-        // This is for O(1) begin() and end()
-        RB_Node _head;
+        // This is for O(1) begin() and end(). The header holds no value, so
+        // an empty map never constructs a Key or T
+        RB_Node_Base _head;
         size_t _size;
         key_compare _comp;
+        node_allocator _alloc;
 
 
 
@@ -316,413 +605,709 @@ class Map {
         // HELPER FUNCTIONS //
         //////////////////////
 
-        // Recursive helper function for deleting a tree
-        void deleteHelper(RB_Node*& node) {
-            if (node == nullptr) {
-                return;
-            }
-
-            if (node->left != nullptr) {
-                deleteHelper(node->left);
-            }
-
-            if (node->right != nullptr) {
-                deleteHelper(node->right);
-            }
+        // The header, as the target of links. It is not an RB_Node, so it
+        // must never be cast to one
+        RB_Node_Base* headNode() const {
+            return const_cast<RB_Node_Base*>(&_head);
+        }
 
-            delete node;
-            node = nullptr;
+        // A link that is known to lead to a node rather than the header
+        static RB_Node* asNode(RB_Node_Base* node) {
+            return static_cast<RB_Node*>(node);
         }
 
-        // Recursive helper function for copying a tree
-        RB_Node* copyHelper(RB_Node* otherRoot, const RB_Node* otherHead) {
-            if (otherRoot == nullptr) {
-                return nullptr;
-            }
+        static const RB_Node* asNode(const RB_Node_Base* node) {
+            return static_cast<const RB_Node*>(node);
+        }
 
-            RB_Node* left = copyHelper(otherRoot->left, otherHead);
-            RB_Node* right = copyHelper(otherRoot->right, otherHead);
+        // The root, or nullptr if the tree is empty
+        RB_Node* rootNode() const {
+            return asNode(_head.parent());
+        }
 
-            RB_Node* temp = new RB_Node(otherRoot->value, nullptr, left, right, otherRoot->color);
+        // Allocates a node through the allocator and constructs it from args
+        template<typename... Args>
+        RB_Node* createNode(Args&&... args) {
+            RB_Node* node = node_traits::allocate(_alloc, 1);
 
-            if (left) {
-                left->parent = temp;
+            try {
+                node_traits::construct(_alloc, node, std::forward<Args>(args)...);
+            } catch (...) {
+                node_traits::deallocate(_alloc, node, 1);
+                throw;
             }
 
-            if (right) {
-                right->parent = temp;
-            }
+            return node;
+        }
 
-            // Ensure that the new _head has access to min and max elements
-            if (otherRoot == otherHead->left) {
-                _head.left = temp;
+        // Like createNode, but takes the node from spare, a list of unused
+        // nodes chained through their right pointers, while there are any.
+        // The old value is destroyed and the new one constructed in place
+        template<typename... Args>
+        RB_Node* reuseOrCreateNode(RB_Node*& spare, Args&&... args) {
+            if (spare == nullptr) {
+                return createNode(std::forward<Args>(args)...);
             }
 
-            if (otherRoot == otherHead->right) {
-                _head.right = temp;
-            }
+            RB_Node* node = spare;
+            spare = asNode(spare->right);
+            node_traits::destroy(_alloc, node);
 
-            return temp;
+            try {
+                node_traits::construct(_alloc, node, std::forward<Args>(args)...);
+            } catch (...) {
+                node_traits::deallocate(_alloc, node, 1);
+                throw;
+            }
 
+            return node;
         }
 
-        // Recursive helper function for finding a value
-        RB_Node* findHelper(RB_Node* node, const key_type& x) {
-            if (node == nullptr) {
-                return nullptr;
-            }
+        // Creates an unlinked copy of src with the same color, reusing a
+        // node from spare if there is one
+        RB_Node* cloneNode(const RB_Node* src, RB_Node* parent, RB_Node*& spare) {
+            RB_Node* node = reuseOrCreateNode(spare, src->value);
+            node->setParent(parent);
+            node->setColor(src->color());
+            static_cast<Augment&>(*node) = static_cast<const Augment&>(*src);
 
-            if (node->value.first == x) { // If at correct node, return it
-                return node;
-            } else if (_comp(x, node->value.first)) { // If current node is greater, go left
-                return findHelper(node->left, x);
-            } else { // Otherwise, go right
-                return findHelper(node->right, x);
-            }
+            return node;
         }
 
-        const RB_Node* findHelper(const RB_Node* node, const key_type& x) const {
-            if (node == nullptr) {
-                return nullptr;
-            }
-
-            if (node->value.first == x) { // If at correct node, return it
-                return node;
-            } else if (_comp(x, node->value.first)) { // If current node is greater, go left
-                return findHelper(node->left, x);
-            } else { // Otherwise, go right
-                return findHelper(node->right, x);
-            }
+        // Destroys a node and returns its memory to the allocator
+        void destroyNode(RB_Node* node) {
+            node_traits::destroy(_alloc, node);
+            node_traits::deallocate(_alloc, node, 1);
         }
 
-        // Recursive helper function for inserting a new node into a tree
-        std::pair<RB_Node*, bool> insertHelper(RB_Node* node, const value_type& x) {
-            if (x.first == node->value.first) {
-                //node->value.second = x.second;
-                return std::pair<RB_Node*, bool>(node, false);
-            } else if (_comp(x.first, node->value.first)) { // If less than current node, move left
-                if (node->left == nullptr) {
-                    node->left = new RB_Node(x, node);
-                    node->left->parent = node;
-                    _size++;
-                    return std::pair<RB_Node*, bool>(node->left, true);
-                } else {
-                    return insertHelper(node->left, x);
-                }
-            } else { // If more than current node, move right
-                if (node->right == nullptr) {
-                    node->right = new RB_Node(x, node);
-                    node->right->parent = node;
-                    _size++;
-                    return std::pair<RB_Node*, bool>(node->right, true);
-                } else {
-                    return insertHelper(node->right, x);
-                }
+        // Helper function for deleting a tree. Walks the tree through the
+        // parent links instead of recursing: descend to a leaf, free it and
+        // continue from its parent. With deallocate set to false only the
+        // values are destroyed and the memory is left to the allocator.
+        // Returns the number of nodes deleted
+        size_t deleteHelper(RB_Node* root, bool deallocate = true) {
+            if (root == nullptr) {
+                return 0;
             }
-        }
 
-        // Recursive helper function for inserting a new node into a tree
-        std::pair<RB_Node*, bool> insertHelper(RB_Node* node, value_type&& x) {
-            if (x.first == node->value.first) {
-                //node->value.second = std::move(x.second);
-                return std::pair<RB_Node*, bool>(node, false);
-            } else if (_comp(x.first, node->value.first)) { // If less than current node, move left
-                if (node->left == nullptr) {
-                    node->left = new RB_Node(std::move(x), node);
-                    node->left->parent = node;
-                    _size++;
-                    return std::pair<RB_Node*, bool>(node->left, true);
-                } else {
-                    return insertHelper(node->left, std::move(x));
-                }
-            } else { // If more than current node, move right
-                if (node->right == nullptr) {
-                    node->right = new RB_Node(std::move(x), node);
-                    node->right->parent = node;
-                    _size++;
-                    return std::pair<RB_Node*, bool>(node->right, true);
+            RB_Node_Base* stop = root->parent();
+            RB_Node_Base* node = root;
+            size_t count = 0;
+
+            while (node != stop) {
+                if (node->left) {
+                    node = node->left;
+                } else if (node->right) {
+                    node = node->right;
                 } else {
-                    return insertHelper(node->right, std::move(x));
-                }
-            }
-        }
+                    RB_Node_Base* p = node->parent();
 
-        bool eraseHelper(RB_Node* node, const key_type& x) {
-            if (node == nullptr) {
-                return false;
-            }
+                    // Unlink the leaf so its parent becomes a leaf in turn
+                    if (p != stop) {
+                        if (p->left == node) {
+                            p->left = nullptr;
+                        } else {
+                            p->right = nullptr;
+                        }
+                    }
 
-            if (_size == 1) {
-                if (!_comp(node->value.first, x) && !_comp(x, node->value.first)) {
-                    delete node;
-                    _head.parent = nullptr;
-                    _head.left = &_head;
-                    _head.right = &_head;
-                    _size--;
-                    return true;
+                    if (deallocate) {
+                        destroyNode(asNode(node));
+                    } else {
+                        node_traits::destroy(_alloc, asNode(node));
+                    }
+                    count++;
+                    node = p;
                 }
-                return false;
             }
 
-            // Step 1: Find the node to delete
-            if (_comp(x, node->value.first)) {
-                return eraseHelper(node->left, x);
-            } else if (_comp(node->value.first, x)) {
-                return eraseHelper(node->right, x);
-            } else { // Correct node has been found
-                // Ensure that min and max behavior is preserved for O(1)
-                // begin() and end()
-                if (node == _head.left) {
-                    _head.left = inorderSuccessor(node);
-                }
-                if (node == _head.right) {
-                    _head.right = inorderPredecessor(node);
-                }
+            return count;
+        }
 
-                // Step 2: Convert to leaf node
-                if (node->right) {
-                    RB_Node* replacement = inorderSuccessor(node);
-                    swapNodes(node, replacement);
-                    return eraseHelper(node, x);
-                } else if (node->left) {
-                    RB_Node* replacement = inorderPredecessor(node);
-                    swapNodes(node, replacement);
-                    return eraseHelper(node, x);
-                } else { // Node to delete is a leaf
-                    // If Red, just delete
-                    if (node->color == Color::Red) {
-                        if (node->parent->left == node) {
-                            node->parent->left = nullptr;
-                        } else if (node->parent->right == node){
-                            node->parent->right = nullptr;
-                        } else {
-                            node->parent->parent = nullptr;
-                        }
+        // Helper function for turning the tree into a list of spare nodes
+        // chained through their right pointers, leaving the map empty. The
+        // values stay alive until the nodes are reused or destroyed
+        RB_Node* detachHelper() {
+            RB_Node* spare = nullptr;
+            RB_Node_Base* node = _head.parent();
 
-                        delete node;
-                        _size--;
-                        return true;
-                    } else { // If black, determine case to fix
-                        resolveDB(node);
+            // Same walk as deleteHelper, but leaves are pushed onto the list
+            while (node != nullptr && node != headNode()) {
+                if (node->left) {
+                    node = node->left;
+                } else if (node->right) {
+                    node = node->right;
+                } else {
+                    RB_Node_Base* p = node->parent();
 
-                        if (node->parent->left == node) {
-                            node->parent->left = nullptr;
+                    if (p != headNode()) {
+                        if (p->left == node) {
+                            p->left = nullptr;
                         } else {
-                            node->parent->right = nullptr;
+                            p->right = nullptr;
                         }
-
-                        delete node;
-                        _size--;
-                        return true;
                     }
+
+                    node->right = spare;
+                    spare = asNode(node);
+                    node = p;
                 }
             }
+
+            _head.setParent(nullptr);
+            _head.left = headNode();
+            _head.right = headNode();
+            _size = 0;
+
+            return spare;
         }
 
-        void resolveDB(RB_Node* n) {
-            // If DB is root, then is fine
-            if (n == _head.parent) {
-                return;
+        // Destroys every node left in a list of spare nodes
+        void destroySpareHelper(RB_Node* spare) {
+            while (spare) {
+                RB_Node* next = asNode(spare->right);
+                destroyNode(spare);
+                spare = next;
             }
+        }
 
-           // Determine what side is sibling
-            RB_Node* sibling;
-            bool onLeft = (n->parent->left == n);
-
-            if (onLeft) {
-                // Sibling is right child 
-                sibling = n->parent->right;
-            } else {
-                // Sibling is left child
-                sibling = n->parent->left;
+        // Helper function for copying a tree. Walks the source tree in
+        // preorder through the parent links and mirrors every node. Nodes
+        // are taken from spare before new ones are allocated
+        RB_Node* copyHelper(const RB_Node* otherRoot, const RB_Node_Base* otherHead, RB_Node*& spare) {
+            if (otherRoot == nullptr) {
+                return nullptr;
             }
 
-            // Far child and near child of sibling
-            RB_Node* farChild = onLeft? (sibling->right): (sibling->left);
-            RB_Node* nearChild = onLeft? (sibling->left): (sibling->right);
+            RB_Node* root = cloneNode(otherRoot, nullptr, spare);
+            const RB_Node* src = otherRoot;
+            RB_Node* dest = root;
 
-            // If DB sibling is black
-            if (sibling->color == Color::Black) {
-                // If sibling has 2 black children
-                if (bothChildBlack(sibling)) {
-                    sibling->color = Color::Red;
-                    if (n->parent->color == Color::Red) {
-                        n->parent->color = Color::Black;
-                    } else {
-                        resolveDB(n->parent);
+            try {
+                while (true) {
+                    // Ensure that the new _head has access to min and max elements
+                    if (src == otherHead->left) {
+                        _head.left = dest;
                     }
-                // Far child is black and near child is red
-                } else if ((!farChild || farChild->color == Color::Black) && nearChild->color == Color::Red) {
-                    std::swap(nearChild->color, sibling->color);
 
-                    if (onLeft) {
-                        n->parent->right = rightRotation(sibling);
-                        n->parent->right->parent = n->parent;
+                    if (src == otherHead->right) {
+                        _head.right = dest;
+                    }
+
+                    if (src->left && !dest->left) { // Copy the left subtree first
+                        dest->left = cloneNode(asNode(src->left), dest, spare);
+                        src = asNode(src->left);
+                        dest = asNode(dest->left);
+                    } else if (src->right && !dest->right) { // Then the right subtree
+                        dest->right = cloneNode(asNode(src->right), dest, spare);
+                        src = asNode(src->right);
+                        dest = asNode(dest->right);
+                    } else if (src != otherRoot) { // Both done, go back up
+                        src = asNode(src->parent());
+                        dest = asNode(dest->parent());
                     } else {
-                        n->parent->left = leftRotation(sibling);
-                        n->parent->left->parent = n->parent;
+                        break;
                     }
+                }
+            } catch (...) {
+                // The min and max links may already point into the copy
+                deleteHelper(root);
+                _head.left = headNode();
+                _head.right = headNode();
+                throw;
+            }
+
+            return root;
+        }
 
-                    resolveDB(n);
-                // Far child is red
-                } else if (farChild->color == Color::Red) {
-                    // Swap parent and sibling colors
-                    std::swap(n->parent->color, sibling->color);
+        // Searches compare three ways when ThreeWayCompare allows it
+        template<typename K>
+        static constexpr bool threeWay() {
+            return ThreeWayCompare<Compare, Key>::template enabled<K>();
+        }
 
-                    RB_Node* grandparent = n->parent->parent;
-                    if (onLeft) {
-                        if (grandparent->left == n->parent) {
-                            grandparent->left = leftRotation(n->parent);
-                        } else if (grandparent->right == n->parent) {
-                            grandparent->right = leftRotation(n->parent);
-                        } else if (grandparent->parent == n->parent) {
-                            grandparent->parent = leftRotation(n->parent);
-                        }
-                        n->parent->parent->parent = grandparent;
+        template<typename K>
+        static int threeWayHelper(const K& x, const Key& key) {
+            return ThreeWayCompare<Compare, Key>::compare(x, key);
+        }
+
+        // Helper function for finding a value. K is key_type, or any type
+        // the comparator can compare with key_type when it is transparent.
+        // Makes one key comparison per level
+        template<typename K>
+        RB_Node* findHelper(RB_Node* node, const K& x) const {
+            if constexpr (threeWay<K>()) {
+                while (node != nullptr) {
+                    int order = threeWayHelper(x, node->value.first);
+
+                    if (order < 0) {
+                        node = asNode(node->left);
+                    } else if (order > 0) {
+                        node = asNode(node->right);
                     } else {
-                        if (grandparent->left == n->parent) {
-                            grandparent->left = rightRotation(n->parent);
-                        } else if (grandparent->right == n->parent) {
-                            grandparent->right = rightRotation(n->parent);
-                        } else if (grandparent->parent == n->parent) {
-                            grandparent->parent = rightRotation(n->parent);
-                        }
-                        n->parent->parent->parent = grandparent;
+                        return node;
                     }
-
-                    farChild->color = Color::Black;
                 }
-            } else { // If DB sibling is red
-                std::swap(n->parent->color, sibling->color);
 
-                RB_Node* grandparent = n->parent->parent;
-                if (onLeft) {
-                    if (grandparent->left == n->parent) {
-                        grandparent->left = leftRotation(n->parent);
-                    } else if (grandparent->right == n->parent) {
-                        grandparent->right = leftRotation(n->parent);
-                    }
-                    n->parent->parent->parent = grandparent;
-                } else {
-                    if (grandparent->left == n->parent) {
-                        grandparent->left = rightRotation(n->parent);
-                    } else if (grandparent->right == n->parent) {
-                        grandparent->right = rightRotation(n->parent);
+                return nullptr;
+            } else {
+                // Descend like lower_bound, remembering the last node not
+                // less than x. x is in the tree only if that node is not
+                // greater than x either
+                RB_Node* candidate = nullptr;
+
+                while (node != nullptr) {
+                    if (_comp(node->value.first, x)) {
+                        node = asNode(node->right);
+                    } else {
+                        candidate = node;
+                        node = asNode(node->left);
                     }
-                    n->parent->parent->parent = grandparent;
                 }
 
-                resolveDB(n);
+                if (candidate && !_comp(x, candidate->value.first)) {
+                    return candidate;
+                }
+
+                return nullptr;
             }
         }
 
-        bool bothChildBlack(RB_Node* n) {
-            if (n->left == nullptr && n->right == nullptr) {
-                return true;
-            }
+        // Where a key belongs in the tree. Either node already holds the key,
+        // or a new node for it hangs from node on the given side (node is
+        // the header when the tree is empty)
+        struct InsertPosition {
+            RB_Node_Base* node;
+            bool exists;
+            bool onLeft;
+        };
 
-            if (n->left == nullptr || n->right == nullptr) {
-                return false;
-            }
+        // Helper function for finding where key x belongs in the tree
+        template<typename K>
+        InsertPosition insertPosHelper(const K& x) {
+            RB_Node_Base* parent = headNode();
+            RB_Node* node = rootNode();
+            bool onLeft = true;
 
-            if (n->left->color == Color::Black && n->right->color == Color::Black) {
-                return true;
-            }
+            if constexpr (threeWay<K>()) {
+                while (node != nullptr) {
+                    int order = threeWayHelper(x, node->value.first);
 
-            return false;
-        }
+                    if (order == 0) { // Key is already in the tree
+                        return InsertPosition{node, true, false};
+                    }
 
-        // n1 and n2 should be valid nodes (not nullptr)
-        // Used for eraseHelper
-        void swapNodes(RB_Node* n1, RB_Node* n2) {
-            if (n1 == n2) {
-                return;
+                    parent = node;
+                    onLeft = (order < 0);
+                    node = asNode(onLeft ? node->left : node->right);
+                }
             } else {
-                RB_Node* temp;
+                // One comparison per level. The last node not greater than
+                // x is the only one that can hold x
+                RB_Node* notGreater = nullptr;
 
-                // Assign new parents
-                if (n1->parent->right == n1) {
-                    n1->parent->right = n2;
-                }
-                if (n1->parent->left == n1) {
-                    n1->parent->left = n2;
-                }
-                if (n1->parent->parent == n1) {
-                    n1->parent->parent = n2;
-                }
-                if (n2->parent->right == n2) {
-                    n2->parent->right = n1;
-                } 
-                if (n2->parent->left == n2) {
-                    n2->parent->left = n1;
+                while (node != nullptr) {
+                    parent = node;
+                    onLeft = _comp(x, node->value.first);
+
+                    if (onLeft) {
+                        node = asNode(node->left);
+                    } else {
+                        notGreater = node;
+                        node = asNode(node->right);
+                    }
                 }
-                if (n2->parent->parent == n2) {
-                    n2->parent->parent = n1;
+
+                if (notGreater && !_comp(notGreater->value.first, x)) {
+                    return InsertPosition{notGreater, true, false};
                 }
-                temp = std::move(n2->parent);
-                n2->parent = std::move(n1->parent);
-                n1->parent = std::move(temp);
+            }
 
-                // Assign new left children
-                temp = std::move(n2->left);
-                n2->left = std::move(n1->left);
-                n1->left = std::move(temp);
-                if (n1->left) {
-                    n1->left->parent = n1;
+            return InsertPosition{parent, false, onLeft};
+        }
+
+        // Helper function for finding where key x belongs, starting from a
+        // hint. If x belongs right before or right after the hint node
+        // (including past either end of the tree), the position is found
+        // with a couple of comparisons instead of a search from the root.
+        // Otherwise, or if hint is nullptr, this falls back to a full search
+        template<typename K>
+        InsertPosition insertPosHelper(RB_Node_Base* hintLink, const K& x) {
+            if (hintLink == nullptr || _head.parent() == nullptr) {
+                return insertPosHelper(x);
+            }
+
+            if (hintLink == headNode()) { // Hint is end(), so x may be a new maximum
+                if (_comp(asNode(_head.right)->value.first, x)) {
+                    return InsertPosition{_head.right, false, false};
                 }
-                if (n2->left) {
-                    n2->left->parent = n2;
+                return insertPosHelper(x);
+            }
+
+            RB_Node* hint = asNode(hintLink);
+            if (_comp(x, hint->value.first)) { // x belongs before hint
+                if (hint == _head.left) {
+                    return InsertPosition{hint, false, true};
                 }
 
-                // Assign new right children
-                temp = std::move(n2->right);
-                n2->right = std::move(n1->right);
-                n1->right = std::move(temp);
-                if (n1->right) {
-                    n1->right->parent = n1;
+                RB_Node* before = asNode(inorderPredecessor(hint));
+                if (_comp(before->value.first, x)) {
+                    // Of two adjacent nodes, either the first has no right
+                    // child or the second has no left child
+                    if (before->right == nullptr) {
+                        return InsertPosition{before, false, false};
+                    }
+                    return InsertPosition{hint, false, true};
                 }
-                if (n2->right) {
-                    n2->right->parent = n2;
+            } else if (_comp(hint->value.first, x)) { // x belongs after hint
+                if (hint == _head.right) {
+                    return InsertPosition{hint, false, false};
                 }
 
-                //Preserve original colors of nodes
-                Color c = std::move(n1->color);
-                n1->color = std::move(n2->color);
-                n2->color = std::move(c);
-                
+                RB_Node* after = asNode(inorderSuccessor(hint));
+                if (_comp(x, after->value.first)) {
+                    if (hint->right == nullptr) {
+                        return InsertPosition{hint, false, false};
+                    }
+                    return InsertPosition{after, false, true};
+                }
+            } else { // Hint holds x
+                return InsertPosition{hint, true, false};
             }
-        }
 
-        RB_Node* inorderSuccessor(RB_Node* node) {
-            if (node->right) {
-                // If there is a right, leftmost node in right subtree is successor
-                node = node->right;
+            return insertPosHelper(x);
+        }
 
-                while (node->left) {
-                    node = node->left;
+        // Helper function for linking a new node into the tree at pos and
+        // restoring the red-black properties. The node may also be one that
+        // was unlinked from a tree before, so its links are reset
+        void insertHelper(const InsertPosition& pos, RB_Node* node) {
+            node->setParent(pos.node);
+            node->left = nullptr;
+            node->right = nullptr;
+            node->setColor(Color::Red);
+
+            if (pos.node == headNode()) { // Add root if tree is empty
+                _head.setParent(node);
+                _head.left = node;
+                _head.right = node;
+            } else if (pos.onLeft) {
+                pos.node->left = node;
+
+                // Hanging left of the minimum makes a new minimum
+                if (pos.node == _head.left) {
+                    _head.left = node;
                 }
             } else {
-                // If there is no right, then go up until you find an unexplored right
-                // The ending node would be the next inorder successor
-                RB_Node* p = node->parent;
-
-                while (node == p->right) {
-                    node = p;
-                    p = p->parent;
-                }
+                pos.node->right = node;
 
-                if (node->right != p) {
-                    node = p;
+                // Hanging right of the maximum makes a new maximum
+                if (pos.node == _head.right) {
+                    _head.right = node;
                 }
             }
 
-            return node;
+            _size++;
+            updatePathHelper(node);
+            insertFixup(node);
         }
 
-        RB_Node* inorderPredecessor(RB_Node* node) {
-            if (node->left) {
-                // If there is a left, rightmost node in left subtree is predecessor
-                node = node->left;
+        // Helper function for inserting a node that was constructed before
+        // its position was known. The node is destroyed if its key exists.
+        // The hint may be nullptr, here and in the helpers below
+        std::pair<RB_Node*, bool> insertNodeHelper(RB_Node_Base* hint, RB_Node* node) {
+            InsertPosition pos;
+
+            try {
+                pos = insertPosHelper(hint, node->value.first);
+            } catch (...) {
+                destroyNode(node);
+                throw;
+            }
+
+            if (pos.exists) {
+                destroyNode(node);
+                return std::pair<RB_Node*, bool>(asNode(pos.node), false);
+            }
+
+            insertHelper(pos, node);
+            return std::pair<RB_Node*, bool>(node, true);
+        }
+
+        // Helper function for try_emplace(): constructs the value from the key
+        // and args only if the key is not in the tree yet
+        template<typename KeyArg, typename... Args>
+        std::pair<RB_Node*, bool> tryEmplaceHelper(RB_Node_Base* hint, KeyArg&& k, Args&&... args) {
+            InsertPosition pos = insertPosHelper(hint, k);
+
+            if (pos.exists) {
+                return std::pair<RB_Node*, bool>(asNode(pos.node), false);
+            }
+
+            RB_Node* node = createNode(std::piecewise_construct,
+                                       std::forward_as_tuple(std::forward<KeyArg>(k)),
+                                       std::forward_as_tuple(std::forward<Args>(args)...));
+            insertHelper(pos, node);
+            return std::pair<RB_Node*, bool>(node, true);
+        }
+
+        // Helper function for insert_or_assign(): assigns obj to the mapped
+        // value if the key exists, otherwise inserts a node built from both
+        template<typename KeyArg, typename M>
+        std::pair<RB_Node*, bool> insertOrAssignHelper(RB_Node_Base* hint, KeyArg&& k, M&& obj) {
+            InsertPosition pos = insertPosHelper(hint, k);
+
+            if (pos.exists) {
+                RB_Node* node = asNode(pos.node);
+                node->value.second = std::forward<M>(obj);
+                updatePathHelper(node);
+                return std::pair<RB_Node*, bool>(node, false);
+            }
+
+            RB_Node* node = createNode(std::forward<KeyArg>(k), std::forward<M>(obj));
+            insertHelper(pos, node);
+            return std::pair<RB_Node*, bool>(node, true);
+        }
+
+        // Helper function for detaching node from the tree and restoring the
+        // red-black properties. The node itself is not destroyed
+        void unlinkHelper(RB_Node* node) {
+            if (_size == 1) {
+                _head.setParent(nullptr);
+                _head.left = headNode();
+                _head.right = headNode();
+                _size--;
+                return;
+            }
+
+            // Ensure that min and max behavior is preserved for O(1)
+            // begin() and end()
+            if (node == _head.left) {
+                _head.left = inorderSuccessor(node);
+            }
+            if (node == _head.right) {
+                _head.right = inorderPredecessor(node);
+            }
+
+            // Step 1: Convert to leaf node. A node with a child has its
+            // neighbor inside its subtree, so the header is never swapped
+            while (node->right || node->left) {
+                if (node->right) {
+                    swapNodes(node, inorderSuccessor(node));
+                } else {
+                    swapNodes(node, inorderPredecessor(node));
+                }
+            }
+
+            // Step 2: If black, determine case to fix before unlinking
+            if (node->color() == Color::Black) {
+                resolveDB(node);
+            }
+
+            if (node->parent()->left == node) {
+                node->parent()->left = nullptr;
+            } else {
+                node->parent()->right = nullptr;
+            }
+
+            // Nodes swapped or rotated above all lie on the path from the
+            // removed leaf to the root, so this also repairs them. A leaf
+            // removed from a tree of two or more nodes has a node as parent
+            updatePathHelper(asNode(node->parent()));
+            _size--;
+        }
+
+        // Helper function for removing node from the tree and destroying it
+        void eraseHelper(RB_Node* node) {
+            unlinkHelper(node);
+            destroyNode(node);
+        }
+
+        // Resolves a double black at n, moving it up the tree until it can
+        // be absorbed by a rotation or a red node
+        void resolveDB(RB_Node* n) {
+            // If DB is root, then is fine
+            while (n != _head.parent()) {
+                // Below the root, the parent is a node
+                RB_Node* parent = asNode(n->parent());
+
+                // Determine what side is sibling
+                RB_Node* sibling;
+                bool onLeft = (parent->left == n);
+
+                if (onLeft) {
+                    // Sibling is right child 
+                    sibling = asNode(parent->right);
+                } else {
+                    // Sibling is left child
+                    sibling = asNode(parent->left);
+                }
+
+                // Far child and near child of sibling
+                RB_Node_Base* farChild = onLeft? (sibling->right): (sibling->left);
+                RB_Node_Base* nearChild = onLeft? (sibling->left): (sibling->right);
+
+                // If DB sibling is black
+                if (sibling->color() == Color::Black) {
+                    // If sibling has 2 black children
+                    if (bothChildBlack(sibling)) {
+                        sibling->setColor(Color::Red);
+                        if (parent->color() == Color::Red) {
+                            parent->setColor(Color::Black);
+                            return;
+                        }
+
+                        // Parent becomes the double black
+                        n = parent;
+                    // Far child is black and near child is red
+                    } else if ((!farChild || farChild->color() == Color::Black) && nearChild->color() == Color::Red) {
+                        swapColors(nearChild, sibling);
+
+                        if (onLeft) {
+                            rotateRight(sibling);
+                        } else {
+                            rotateLeft(sibling);
+                        }
+                    // Far child is red
+                    } else {
+                        // Swap parent and sibling colors
+                        swapColors(parent, sibling);
+
+                        if (onLeft) {
+                            rotateLeft(parent);
+                        } else {
+                            rotateRight(parent);
+                        }
+
+                        farChild->setColor(Color::Black);
+                        return;
+                    }
+                } else { // If DB sibling is red
+                    swapColors(parent, sibling);
+
+                    if (onLeft) {
+                        rotateLeft(parent);
+                    } else {
+                        rotateRight(parent);
+                    }
+                }
+            }
+        }
+
+        bool bothChildBlack(RB_Node_Base* n) {
+            if (n->left == nullptr && n->right == nullptr) {
+                return true;
+            }
+
+            if (n->left == nullptr || n->right == nullptr) {
+                return false;
+            }
+
+            if (n->left->color() == Color::Black && n->right->color() == Color::Black) {
+                return true;
+            }
+
+            return false;
+        }
+
+        // Exchanges the colors of two nodes
+        void swapColors(RB_Node_Base* n1, RB_Node_Base* n2) {
+            Color c = n1->color();
+            n1->setColor(n2->color());
+            n2->setColor(c);
+        }
+
+        // n1 and n2 should be valid nodes (not nullptr)
+        // Used for unlinkHelper
+        void swapNodes(RB_Node_Base* n1, RB_Node_Base* n2) {
+            if (n1 == n2) {
+                return;
+            } else {
+                RB_Node_Base* temp;
+
+                // Assign new parents
+                if (n1->parent()->right == n1) {
+                    n1->parent()->right = n2;
+                }
+                if (n1->parent()->left == n1) {
+                    n1->parent()->left = n2;
+                }
+                if (n1->parent()->parent() == n1) {
+                    n1->parent()->setParent(n2);
+                }
+                if (n2->parent()->right == n2) {
+                    n2->parent()->right = n1;
+                } 
+                if (n2->parent()->left == n2) {
+                    n2->parent()->left = n1;
+                }
+                if (n2->parent()->parent() == n2) {
+                    n2->parent()->setParent(n1);
+                }
+                temp = n2->parent();
+                n2->setParent(n1->parent());
+                n1->setParent(temp);
+
+                // Assign new left children
+                temp = std::move(n2->left);
+                n2->left = std::move(n1->left);
+                n1->left = std::move(temp);
+                if (n1->left) {
+                    n1->left->setParent(n1);
+                }
+                if (n2->left) {
+                    n2->left->setParent(n2);
+                }
+
+                // Assign new right children
+                temp = std::move(n2->right);
+                n2->right = std::move(n1->right);
+                n1->right = std::move(temp);
+                if (n1->right) {
+                    n1->right->setParent(n1);
+                }
+                if (n2->right) {
+                    n2->right->setParent(n2);
+                }
+
+                //Preserve original colors of nodes
+                swapColors(n1, n2);
+                
+            }
+        }
+
+        // The node after node, or the header after the maximum
+        RB_Node_Base* inorderSuccessor(RB_Node_Base* node) const {
+            if (node->right) {
+                // If there is a right, leftmost node in right subtree is successor
+                node = node->right;
+
+                while (node->left) {
+                    node = node->left;
+                }
+            } else {
+                // If there is no right, then go up until you find an unexplored right
+                // The ending node would be the next inorder successor
+                RB_Node_Base* p = node->parent();
+
+                while (node == p->right) {
+                    node = p;
+                    p = p->parent();
+                }
+
+                if (node->right != p) {
+                    node = p;
+                }
+            }
+
+            return node;
+        }
+
+        // The node before node, or the header before the minimum
+        RB_Node_Base* inorderPredecessor(RB_Node_Base* node) const {
+            if (node->left) {
+                // If there is a left, rightmost node in left subtree is predecessor
+                node = node->left;
 
                 while (node->right) {
                     node = node->right;
@@ -730,11 +1315,11 @@ class Map {
             } else {
                 // If there is no left, then go up until you find an unexplored left
                 // The ending node would be the next inorder predecessor
-                RB_Node* p = node->parent;
+                RB_Node_Base* p = node->parent();
 
                 while (node == p->left) {
                     node = p;
-                    p = p->parent;
+                    p = p->parent();
                 }
 
                 if (node->left != p) {
@@ -745,245 +1330,1489 @@ class Map {
             return node;
         }
 
-        RB_Node* boundHelper(RB_Node* node, const key_type& x) {
-            if (node == nullptr) {
-                return nullptr;
-            }
+        // Helper function for lower_bound(): first node not less than x,
+        // or the header if there is none
+        template<typename K>
+        RB_Node_Base* lowerBoundHelper(const K& x) const {
+            RB_Node_Base* result = headNode();
+            RB_Node* node = rootNode();
 
-            if (node->value.first == x) { // If at correct node, return it
-                return node;
-            } else if (_comp(x, node->value.first)) { // If current node is greater, go left
-                if (node->left) {
-                    return boundHelper(node->left, x);
+            while (node != nullptr) {
+                if (_comp(node->value.first, x)) {
+                    node = asNode(node->right);
                 } else {
-                    return node;
+                    result = node;
+                    node = asNode(node->left);
                 }
-            } else { // Otherwise, go right
+            }
 
-                if (node->right) {
-                    return boundHelper(node->right, x);
+            return result;
+        }
+
+        // Helper function for upper_bound(): last node not greater than x,
+        // or the header if there is none
+        template<typename K>
+        RB_Node_Base* upperBoundHelper(const K& x) const {
+            RB_Node_Base* result = headNode();
+            RB_Node* node = rootNode();
+
+            while (node != nullptr) {
+                if (_comp(x, node->value.first)) {
+                    node = asNode(node->left);
                 } else {
-                    return node;
+                    result = node;
+                    node = asNode(node->right);
                 }
-                
             }
+
+            return result;
         }
 
-        const RB_Node* boundHelper(RB_Node* node, const key_type& x) const {
-            if (node == nullptr) {
-                return nullptr;
+        // Helper function for equal_range(): the node with key x and its
+        // successor, or an empty range at x's position
+        template<typename K>
+        std::pair<RB_Node_Base*, RB_Node_Base*> equalRangeHelper(const K& x) const {
+            RB_Node_Base* lower = lowerBoundHelper(x);
+
+            if (lower != headNode() && !_comp(x, asNode(lower)->value.first)) {
+                return std::pair<RB_Node_Base*, RB_Node_Base*>(lower, inorderSuccessor(lower));
             }
 
-            if (node->value.first == x) { // If at correct node, return it
-                return node;
-            } else if (_comp(x, node->value.first)) { // If current node is greater, go left
-                if (node->left) {
-                    return boundHelper(node->left, x);
-                } else {
-                    return node;
+            return std::pair<RB_Node_Base*, RB_Node_Base*>(lower, lower);
+        }
+
+        // Helper function for find_batch and lower_bound_batch. Looks up the
+        // sorted keys of [first, last) in the subtree at node, all of whose
+        // keys are less than bound's, in one descent: the keys less than
+        // node's go to the left subtree, then those equal to it find node,
+        // and the rest go on to the right. Every node on the search path of
+        // some key is visited once, however many keys share it. Writes an
+        // Iter to the lower bound of every key to out, or with exact set,
+        // to the element with the key or the end
+        template<typename Iter, typename ForwardIter, typename OutputIter>
+        OutputIter batchHelper(RB_Node* node, RB_Node_Base* bound, ForwardIter first, ForwardIter last, OutputIter out, bool exact) const {
+            auto before = [this](const auto& x, const Key& k) {
+                return _comp(x, k);
+            };
+
+            while (first != last) {
+                // A single key left is looked up with a plain descent, and
+                // for find with findHelper, the same search find uses
+                if (node != nullptr && std::next(first) == last) {
+                    const auto& x = *first;
+                    RB_Node_Base* result = bound;
+
+                    if (exact) {
+                        RB_Node* found = findHelper(node, x);
+                        result = found ? static_cast<RB_Node_Base*>(found) : headNode();
+                    } else {
+                        while (node != nullptr) {
+                            if (_comp(node->value.first, x)) {
+                                node = asNode(node->right);
+                            } else {
+                                result = node;
+                                node = asNode(node->left);
+                            }
+                        }
+                    }
+
+                    *out = Iter(result);
+                    ++out;
+                    return out;
                 }
-            } else { // Otherwise, go right
 
-                if (node->right) {
-                    return boundHelper(node->right, x);
-                } else {
-                    return node;
+                if (node == nullptr) {
+                    for (; first != last; ++first) {
+                        *out = Iter(exact ? headNode() : bound);
+                        ++out;
+                    }
+                    return out;
                 }
-                
+
+                ForwardIter mid = std::lower_bound(first, last, node->value.first, before);
+                out = batchHelper<Iter>(asNode(node->left), node, first, mid, out, exact);
+
+                for (; mid != last && !_comp(node->value.first, *mid); ++mid) {
+                    *out = Iter(node);
+                    ++out;
+                }
+
+                first = mid;
+                node = asNode(node->right);
             }
+
+            return out;
+        }
+
+        // Number of searches find_many keeps in flight. Enough to cover
+        // the latency of a cache miss with the work of the other searches
+        static constexpr size_t findManyWidth = 16;
+
+        // Asks the processor to start loading node into the cache
+        static void prefetchNode(const RB_Node* node) {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(node);
+#else
+            (void)node;
+#endif
         }
 
+        // Helper function for find_many. Runs up to findManyWidth searches
+        // in turn, one tree level each (asynchronous memory access
+        // chaining). After a step a search prefetches its next node and
+        // waits while the others take their steps, so the cache misses of
+        // all of them overlap instead of stalling one after another. A
+        // finished search writes its result and hands its slot to the next
+        // key. Makes one key comparison per level, like findHelper
+        template<typename Iter, typename ForwardIter, typename RandomIter>
+        void findManyHelper(ForwardIter first, ForwardIter last, RandomIter results) const {
+            struct Search {
+                ForwardIter key;
+                RB_Node* node;
+                RB_Node* candidate;
+                size_t index;
+            };
+
+            Search searches[findManyWidth];
+            RB_Node* root = rootNode();
+            size_t active = 0;
+            size_t index = 0;
+
+            prefetchNode(root);
+            for (; active < findManyWidth && first != last; ++first) {
+                searches[active++] = Search{first, root, nullptr, index++};
+            }
+
+            while (active > 0) {
+                for (size_t i = 0; i < active;) {
+                    Search& search = searches[i];
+                    const auto& x = *search.key;
+                    RB_Node* node = search.node;
+                    RB_Node* found = nullptr;
+                    bool done = (node == nullptr);
+
+                    if (!done) {
+                        if constexpr (threeWay<typename std::iterator_traits<ForwardIter>::value_type>()) {
+                            int order = threeWayHelper(x, node->value.first);
+                            if (order == 0) {
+                                found = node;
+                                done = true;
+                            } else {
+                                search.node = asNode((order < 0) ? node->left : node->right);
+                            }
+                        } else {
+                            if (_comp(node->value.first, x)) {
+                                search.node = asNode(node->right);
+                            } else {
+                                search.candidate = node;
+                                search.node = asNode(node->left);
+                            }
+                        }
+                    } else if (search.candidate && !_comp(x, search.candidate->value.first)) {
+                        found = search.candidate;
+                    }
+
+                    if (!done) {
+                        prefetchNode(search.node);
+                        i++;
+                        continue;
+                    }
+
+                    results[static_cast<typename std::iterator_traits<RandomIter>::difference_type>(search.index)] = Iter(found ? static_cast<RB_Node_Base*>(found) : headNode());
+
+                    if (first != last) {
+                        search = Search{first, root, nullptr, index++};
+                        ++first;
+                        i++;
+                    } else {
+                        search = searches[--active];
+                    }
+                }
+            }
+        }
 
         /////////////////////////
         // REBALANCING HELPERS //
         /////////////////////////
 
+        // True if the policy keeps data that has to be updated
+        static constexpr bool augmented = !std::is_same<Augment, NoAugment>::value;
+
+        // Recomputes the policy data of node from its value and children
+        void updateNode(RB_Node* node) {
+            if constexpr (augmented) {
+                node->update(node->value, asNode(node->left), asNode(node->right));
+            }
+        }
+
+        // Recomputes the policy data of node and every node above it
+        void updatePathHelper(RB_Node* node) {
+            if constexpr (augmented) {
+                for (RB_Node_Base* n = node; n != headNode(); n = n->parent()) {
+                    updateNode(asNode(n));
+                }
+            }
+        }
+
         // Function for a right rotation
         RB_Node* rightRotation(RB_Node* root) {
-            RB_Node* temp = root->left->right;
-            RB_Node* newRoot = root->left;
+            RB_Node_Base* temp = root->left->right;
+            RB_Node* newRoot = asNode(root->left);
 
-            root->left->right = root;
+            newRoot->right = root;
             root->left = temp;
-            root->parent = newRoot;
+            root->setParent(newRoot);
             if (temp) {
-                temp->parent = root;
+                temp->setParent(root);
             }
 
+            updateNode(root);
+            updateNode(newRoot);
             return newRoot;
         }
 
         // Function for a left rotation
         RB_Node* leftRotation(RB_Node* root) {
-            RB_Node* temp = root->right->left;
-            RB_Node* newRoot = root->right;
+            RB_Node_Base* temp = root->right->left;
+            RB_Node* newRoot = asNode(root->right);
 
-            root->right->left = root;
+            newRoot->left = root;
             root->right = temp;
-            root->parent = newRoot;
+            root->setParent(newRoot);
             if (temp) {
-                temp->parent = root;
+                temp->setParent(root);
             }
 
+            updateNode(root);
+            updateNode(newRoot);
             return newRoot;
         }
 
         // Function for recoloring a node and its children
-        void recolor(RB_Node* root) {
-            root->color = Color::Red;
-            root->left->color = Color::Black;
-            root->right->color = Color::Black;
+        void recolor(RB_Node_Base* root) {
+            root->setColor(Color::Red);
+            root->left->setColor(Color::Black);
+            root->right->setColor(Color::Black);
         }
 
-        // Recursive helper function for rebalancing a tree
-        RB_Node* rebalanceHelper(RB_Node* node) {
-
-            // No rebalancing if nullptr
-            if (node == nullptr) {
-                return nullptr;
+        // Rotates the subtree rooted at node to the left and relinks the
+        // new subtree root to node's old parent (or to _head if node was root)
+        void rotateLeft(RB_Node* node) {
+            RB_Node_Base* p = node->parent();
+            RB_Node* newRoot = leftRotation(node);
+
+            newRoot->setParent(p);
+            if (p == headNode()) {
+                _head.setParent(newRoot);
+            } else if (p->left == node) {
+                p->left = newRoot;
+            } else {
+                p->right = newRoot;
             }
+        }
 
-            // Assign left child to rebalanced left subtree
-            node->left = rebalanceHelper(node->left);
-            if (node->left) {
-                node->left->parent = node;
+        // Rotates the subtree rooted at node to the right and relinks the
+        // new subtree root to node's old parent (or to _head if node was root)
+        void rotateRight(RB_Node* node) {
+            RB_Node_Base* p = node->parent();
+            RB_Node* newRoot = rightRotation(node);
+
+            newRoot->setParent(p);
+            if (p == headNode()) {
+                _head.setParent(newRoot);
+            } else if (p->left == node) {
+                p->left = newRoot;
+            } else {
+                p->right = newRoot;
             }
+        }
 
-            // Assign right child to rebalanced right subtree
-            node->right = rebalanceHelper(node->right);
-            if (node->right) {
-                node->right->parent = node;
+        // Restores the red-black properties after node has been linked in as a
+        // new red leaf. Walks up from node using parent links, so only the
+        // O(log n) nodes on the path to the root are ever touched
+        void insertFixup(RB_Node* node) {
+            while (node != _head.parent() && node->parent()->color() == Color::Red) {
+                // A red parent is a node and never the root, so the
+                // grandparent is a node too
+                RB_Node* p = asNode(node->parent());
+                RB_Node* grandparent = asNode(p->parent());
+
+                if (p == grandparent->left) {
+                    RB_Node_Base* uncle = grandparent->right;
+
+                    if (uncle && uncle->color() == Color::Red) { // Uncle is red (recolor and move up)
+                        recolor(grandparent);
+                        node = grandparent;
+                    } else {
+                        if (node == p->right) { // Double right rotation
+                            rotateLeft(p);
+                            node = p;
+                            p = asNode(node->parent());
+                        }
+
+                        // Right rotation
+                        p->setColor(Color::Black);
+                        grandparent->setColor(Color::Red);
+                        rotateRight(grandparent);
+                    }
+                } else {
+                    RB_Node_Base* uncle = grandparent->left;
+
+                    if (uncle && uncle->color() == Color::Red) { // Uncle is red (recolor and move up)
+                        recolor(grandparent);
+                        node = grandparent;
+                    } else {
+                        if (node == p->left) { // Double left rotation
+                            rotateRight(p);
+                            node = p;
+                            p = asNode(node->parent());
+                        }
+
+                        // Left rotation
+                        p->setColor(Color::Black);
+                        grandparent->setColor(Color::Red);
+                        rotateLeft(grandparent);
+                    }
+                }
             }
 
-            if (node->left != nullptr && node->left->left != nullptr) {
+            // Root must be black
+            _head.parent()->setColor(Color::Black);
+        }
 
-                if (node->left->color == Color::Red && node->left->left->color == Color::Red) {
+        //////////////////////////////
+        // ORDER STATISTICS HELPERS //
+        //////////////////////////////
 
-                    if (node->right != nullptr && node->right->color == Color::Red) { // Uncle is red (recolor)
-                        recolor(node);
+        static constexpr bool orderStatistics = std::is_base_of<OrderStatistics, Augment>::value;
 
-                        return node;
-                    } else { // Right rotation
-                        RB_Node* newRoot = rightRotation(node);
-                        newRoot->color = Color::Black;
-                        node->color = Color::Red;
+        static size_t subtreeSize(const RB_Node_Base* node) {
+            return node ? asNode(node)->size : 0;
+        }
 
-                        return newRoot;
-                    }
-                }
-            } 
-            
-            if (node->left != nullptr && node->left->right != nullptr) {
-                if (node->left->color == Color::Red && node->left->right->color == Color::Red) {
-                    if (node->right != nullptr && node->right->color == Color::Red) { // Uncle is red (recolor)
-                        recolor(node);
+        // Number of elements before node, or the size of the map if node is
+        // the header. Walks up to the root, adding the left subtrees passed
+        static size_t nodeRank(const RB_Node_Base* node) {
+            static_assert(orderStatistics, "Iterator subtraction requires the OrderStatistics augment");
 
-                        return node;
-                    } else { // Double right rotation
-                        node->left = leftRotation(node->left);
-                        node->left->parent = node;
-                        RB_Node* newRoot = rightRotation(node);
-                        node->color = Color::Red;
-                        newRoot->color = Color::Black;
-
-                        return newRoot;
-                    }
+            if (node->parent() == nullptr) { // Header of an empty tree
+                return 0;
+            }
+            if (node->parent()->parent() == node && node->color() == Color::Red) { // Header
+                return subtreeSize(node->parent());
+            }
+
+            size_t rank = subtreeSize(node->left);
+            while (node->parent()->parent() != node) {
+                if (node->parent()->right == node) {
+                    rank += subtreeSize(node->parent()->left) + 1;
                 }
-            } 
-            
-            if (node->right != nullptr && node->right->right != nullptr) {
+                node = node->parent();
+            }
 
-                if (node->right->color == Color::Red && node->right->right->color == Color::Red) {
+            return rank;
+        }
 
-                    if (node->left != nullptr && node->left->color == Color::Red) { // Uncle is red (recolor)
-                        recolor(node);
+        // Helper function for rank(): number of elements less than x
+        template<typename K>
+        size_t rankHelper(const K& x) const {
+            static_assert(orderStatistics, "rank() requires the OrderStatistics augment");
 
-                        return node;
-                    } else { // Left rotation
-                        RB_Node* newRoot = leftRotation(node);
-                        newRoot->color = Color::Black;
-                        node->color = Color::Red;
+            size_t rank = 0;
+            const RB_Node* node = rootNode();
 
-                        return newRoot;
-                    }
+            while (node != nullptr) {
+                if (_comp(node->value.first, x)) {
+                    rank += subtreeSize(node->left) + 1;
+                    node = asNode(node->right);
+                } else {
+                    node = asNode(node->left);
                 }
-            } 
-            
-            if (node->right != nullptr && node->right->left != nullptr) {
-                if (node->right->color == Color::Red && node->right->left->color == Color::Red) {
-                    if (node->left != nullptr && node->left->color == Color::Red) { // Uncle is red (recolor)
-                        recolor(node);
+            }
 
-                        return node;
-                    } else { // Double left rotation
-                        node->right = rightRotation(node->right);
-                        node->right->parent = node;
-                        RB_Node* newRoot = leftRotation(node);
-                        node->color = Color::Red;
-                        newRoot->color = Color::Black;
-
-                        return newRoot;
-                    }
+            return rank;
+        }
+
+        // Helper function for select(): the node with k elements before it,
+        // or the header if k is not less than the size
+        RB_Node_Base* selectHelper(size_t k) const {
+            static_assert(orderStatistics, "select() requires the OrderStatistics augment");
+
+            RB_Node_Base* node = _head.parent();
+
+            while (node != nullptr) {
+                size_t leftSize = subtreeSize(node->left);
+
+                if (k < leftSize) {
+                    node = node->left;
+                } else if (k > leftSize) {
+                    k -= leftSize + 1;
+                    node = node->right;
+                } else {
+                    return node;
                 }
             }
 
-            // If no changes need to be made, return the subtree
-            return node;
+            return headNode();
         }
 
-        // Function for rebalancing a tree
-        void rebalance() {
-            // New root after rebalancing
-            _head.parent = rebalanceHelper(_head.parent);
-            _head.parent->parent = &_head;
+        ///////////////////////
+        // AGGREGATE HELPERS //
+        ///////////////////////
+
+        using aggregate_type = typename aggregate_value<Augment>::type;
+
+        // Helper function for aggregate(): combines the mapped values of
+        // the keys in [lo, hi). Descends to the first node inside the range,
+        // then down both of its boundaries. Whole subtrees that lie inside
+        // the range contribute their cached total
+        template<typename K>
+        aggregate_type aggregateHelper(const K& lo, const K& hi) const {
+            static_assert(!std::is_void<aggregate_type>::value, "aggregate() requires an Aggregate augment");
+            using Monoid = typename Augment::monoid_type;
+
+            const RB_Node* split = rootNode();
+            while (split != nullptr) {
+                if (_comp(split->value.first, lo)) {
+                    split = asNode(split->right);
+                } else if (!_comp(split->value.first, hi)) {
+                    split = asNode(split->left);
+                } else {
+                    break;
+                }
+            }
+
+            if (split == nullptr) {
+                return Monoid::identity();
+            }
+
+            // Everything found on the lower boundary comes before what was
+            // found so far, since each step moves to smaller keys
+            aggregate_type below = Monoid::identity();
+            for (const RB_Node* node = asNode(split->left); node != nullptr;) {
+                if (_comp(node->value.first, lo)) {
+                    node = asNode(node->right);
+                } else {
+                    if (node->right) {
+                        below = Monoid::combine(asNode(node->right)->total, below);
+                    }
+                    below = Monoid::combine(node->value.second, below);
+                    node = asNode(node->left);
+                }
+            }
+
+            // And on the upper boundary it comes after
+            aggregate_type above = Monoid::identity();
+            for (const RB_Node* node = asNode(split->right); node != nullptr;) {
+                if (!_comp(node->value.first, hi)) {
+                    node = asNode(node->left);
+                } else {
+                    if (node->left) {
+                        above = Monoid::combine(above, asNode(node->left)->total);
+                    }
+                    above = Monoid::combine(above, node->value.second);
+                    node = asNode(node->right);
+                }
+            }
+
+            return Monoid::combine(Monoid::combine(below, split->value.second), above);
+        }
+
+        // Helper function for inserting the node owned by a node handle
+        insert_return_type insertHandleHelper(RB_Node_Base* hint, node_type&& nh) {
+            if (nh.empty()) {
+                return insert_return_type{end(), false, node_type()};
+            }
+
+            InsertPosition pos = insertPosHelper(hint, nh._node->value.first);
+
+            if (pos.exists) {
+                return insert_return_type{iterator(pos.node), false, std::move(nh)};
+            }
+
+            RB_Node* node = nh.release();
+            insertHelper(pos, node);
+            return insert_return_type{iterator(node), true, node_type()};
+        }
+
+        // Takes over the nodes of other, leaving it empty. This map must be
+        // empty and its allocator must be able to free other's nodes
+        void stealTree(Map& other) {
+            _head.setParent(other._head.parent());
+            if (other._size > 0) {
+                _head.parent()->setParent(headNode());
+                _head.left = other._head.left;
+                _head.right = other._head.right;
+            } else {
+                _head.setParent(nullptr);
+                _head.left = headNode();
+                _head.right = headNode();
+            }
+            _size = other._size;
+
+            other._head.setParent(nullptr);
+            other._head.left = other.headNode();
+            other._head.right = other.headNode();
+            other._size = 0;
+        }
+
+        // Helper function for building the tree out of a sorted range in O(n).
+        // The map must be empty. The nodes are first created in order and
+        // chained through their right pointers, then linked into a tree with
+        // the middle node as root, so every level is full except the last.
+        // Coloring the nodes of that partial last level red keeps the black
+        // height the same on every path. If verify is true, the keys are
+        // checked to be strictly increasing. On an exception every new node
+        // is destroyed and the map stays empty
+        template<typename InputIter>
+        void buildSortedHelper(InputIter first, InputIter last, bool verify) {
+            RB_Node* list = nullptr;
+            RB_Node* tail = nullptr;
+            size_t n = 0;
+
+            try {
+                for (; first != last; ++first) {
+                    RB_Node* node = createNode(*first);
+
+                    if (tail) {
+                        tail->right = node;
+                    } else {
+                        list = node;
+                    }
+
+                    if (verify && tail && !_comp(tail->value.first, node->value.first)) {
+                        throw std::invalid_argument("Range is not sorted by unique keys");
+                    }
+
+                    tail = node;
+                    n++;
+                }
+            } catch (...) {
+                while (list) {
+                    RB_Node* next = asNode(list->right);
+                    destroyNode(list);
+                    list = next;
+                }
+                throw;
+            }
+
+            if (n == 0) {
+                return;
+            }
+
+            // Depth of the first level that is not full
+            size_t redDepth = 0;
+            while ((size_t(2) << redDepth) - 1 <= n) {
+                redDepth++;
+            }
+
+            _head.left = list;
+            _head.right = tail;
+            _head.setParent(buildSubtreeHelper(list, n, 0, redDepth));
+            _head.parent()->setParent(headNode());
+            _size = n;
+        }
+
+        // Helper function for buildSortedHelper. Links the next n nodes of
+        // list into a balanced subtree at the given depth and returns its root
+        RB_Node* buildSubtreeHelper(RB_Node*& list, size_t n, size_t depth, size_t redDepth) {
+            if (n == 0) {
+                return nullptr;
+            }
+
+            size_t leftSize = (n - 1) / 2;
+            RB_Node* left = buildSubtreeHelper(list, leftSize, depth + 1, redDepth);
+
+            RB_Node* node = list;
+            list = asNode(list->right);
+
+            node->left = left;
+            if (left) {
+                left->setParent(node);
+            }
+
+            node->right = buildSubtreeHelper(list, n - 1 - leftSize, depth + 1, redDepth);
+            if (node->right) {
+                node->right->setParent(node);
+            }
+
+            node->setColor((depth == redDepth) ? Color::Red : Color::Black);
+            updateNode(node);
+            return node;
+        }
+
+        //////////////////////
+        // PARALLEL HELPERS //
+        //////////////////////
+
+        // Depth down to which the parallel algorithms hand the two subtrees
+        // of a node to separate tasks. Below it every subtree holds about
+        // grain elements and is walked by a single task
+        size_t splitDepth(const parallel_policy& policy) const {
+            size_t depth = 0;
+            for (size_t n = _size / policy.grain(); n > 1; n /= 2) {
+                depth++;
+            }
+
+            return depth;
+        }
+
+        // Helper function for the parallel for_each. NodePtr is RB_Node* or
+        // const RB_Node*, which decides whether f sees const values
+        template<typename NodePtr, typename F>
+        static void forEachHelper(NodePtr node, F& f, size_t depth, ThreadPool& pool) {
+            NodePtr left = static_cast<NodePtr>(node->left);
+            NodePtr right = static_cast<NodePtr>(node->right);
+
+            if (depth > 0 && left && right) {
+                pool.invoke([&] { forEachHelper(left, f, depth - 1, pool); },
+                            [&] { forEachHelper(right, f, depth - 1, pool); });
+                f(node->value);
+                return;
+            }
+
+            if (left) {
+                forEachHelper(left, f, 0, pool);
+            }
+            f(node->value);
+            if (right) {
+                forEachHelper(right, f, 0, pool);
+            }
+        }
+
+        // Helper function for transform_reduce. Combines the transformed
+        // values of the subtree in key order, so op only needs to be
+        // associative
+        template<typename U, typename Reduce, typename Transform>
+        static U reduceHelper(const RB_Node* node, Reduce& op, Transform& transform, size_t depth, ThreadPool& pool) {
+            const RB_Node* left = asNode(node->left);
+            const RB_Node* right = asNode(node->right);
+
+            if (depth > 0 && left && right) {
+                std::optional<U> l;
+                std::optional<U> r;
+                pool.invoke([&] { l.emplace(reduceHelper<U>(left, op, transform, depth - 1, pool)); },
+                            [&] { r.emplace(reduceHelper<U>(right, op, transform, depth - 1, pool)); });
+
+                return op(op(std::move(*l), transform(node->value)), std::move(*r));
+            }
+
+            U result = left ? op(reduceHelper<U>(left, op, transform, 0, pool), transform(node->value))
+                            : U(transform(node->value));
+            if (right) {
+                result = op(std::move(result), reduceHelper<U>(right, op, transform, 0, pool));
+            }
+
+            return result;
+        }
+
+        // Stable merge sort of [first, last) by key. The halves are sorted
+        // by separate tasks until they are smaller than grain
+        template<typename RandomIter>
+        void parallelSortHelper(RandomIter first, RandomIter last, size_t grain, ThreadPool& pool) const {
+            auto byKey = [this](const std::pair<Key, T>& x, const std::pair<Key, T>& y) {
+                return _comp(x.first, y.first);
+            };
+
+            if (static_cast<size_t>(last - first) <= grain) {
+                std::stable_sort(first, last, byKey);
+                return;
+            }
+
+            RandomIter mid = first + (last - first) / 2;
+            pool.invoke([&] { parallelSortHelper(first, mid, grain, pool); },
+                        [&] { parallelSortHelper(mid, last, grain, pool); });
+            std::inplace_merge(first, mid, last, byKey);
+        }
+
+        // Frees a subtree that is not linked into the tree and returns the
+        // number of nodes freed
+        size_t deleteSubtreeHelper(RB_Node* root) {
+            if (root == nullptr) {
+                return 0;
+            }
+
+            root->setParent(nullptr);
+            return deleteHelper(root);
+        }
+
+        // Like buildSubtreeHelper, but builds the balanced subtree out of the
+        // n sorted elements at items, moving them into new nodes. Subtrees
+        // larger than grain build their two halves in separate tasks. If
+        // anything throws, the nodes built so far are freed
+        RB_Node* buildParallelHelper(std::pair<Key, T>* items, size_t n, size_t depth, size_t redDepth, size_t grain, ThreadPool& pool) {
+            if (n == 0) {
+                return nullptr;
+            }
+
+            size_t leftSize = (n - 1) / 2;
+            RB_Node* left = nullptr;
+            RB_Node* right = nullptr;
+            RB_Node* node = nullptr;
+
+            auto buildLeft = [&] { left = buildParallelHelper(items, leftSize, depth + 1, redDepth, grain, pool); };
+            auto buildRight = [&] { right = buildParallelHelper(items + leftSize + 1, n - 1 - leftSize, depth + 1, redDepth, grain, pool); };
+
+            // Within a task the nodes are created in key order, so that
+            // iterating the tree later walks memory mostly in order
+            try {
+                if (n > grain) {
+                    node = createNode(std::move(items[leftSize]));
+                    pool.invoke(buildLeft, buildRight);
+                } else {
+                    buildLeft();
+                    node = createNode(std::move(items[leftSize]));
+                    buildRight();
+                }
+            } catch (...) {
+                if (node) {
+                    destroyNode(node);
+                }
+                deleteSubtreeHelper(left);
+                deleteSubtreeHelper(right);
+                throw;
+            }
+
+            node->left = left;
+            if (left) {
+                left->setParent(node);
+            }
+
+            node->right = right;
+            if (right) {
+                right->setParent(node);
+            }
+
+            node->setColor((depth == redDepth) ? Color::Red : Color::Black);
+            updateNode(node);
+            return node;
+        }
+
+
+        ////////////////////////////
+        // JOIN AND SPLIT HELPERS //
+        ////////////////////////////
+
+        // A subtree that is not linked into the tree, with its black height:
+        // the number of black nodes on every path from its root down to a
+        // null child. The root may be red. Joining two subtrees takes time
+        // proportional to the difference of their black heights, so the
+        // heights are carried along instead of being counted again
+        struct Subtree {
+            RB_Node* root = nullptr;
+            size_t height = 0;
+        };
+
+        // A subtree cut at a key: the smaller keys, the node holding the key
+        // if there is one, and the greater keys
+        struct SplitResult {
+            Subtree less;
+            RB_Node* node = nullptr;
+            Subtree greater;
+        };
+
+        // Colliding values keep the one of this map, like merge() does
+        struct KeepOwn {
+            T operator()(T&& own, const T&) const {
+                return std::move(own);
+            }
+        };
+
+        static bool isRed(const RB_Node_Base* node) {
+            return node && node->color() == Color::Red;
+        }
+
+        // Black height of the subtrees of a node whose subtree has the given
+        // black height
+        static size_t childHeight(const RB_Node_Base* node, size_t height) {
+            return isRed(node) ? height : height - 1;
+        }
+
+        static size_t blackHeight(const RB_Node_Base* node) {
+            size_t height = 0;
+            for (; node != nullptr; node = node->left) {
+                if (!isRed(node)) {
+                    height++;
+                }
+            }
+
+            return height;
+        }
+
+        // Makes left and right the children of node
+        void linkHelper(RB_Node* node, RB_Node* left, RB_Node* right) {
+            node->left = left;
+            if (left) {
+                left->setParent(node);
+            }
+
+            node->right = right;
+            if (right) {
+                right->setParent(node);
+            }
+
+            updateNode(node);
+        }
+
+        // Takes the whole tree out of the map, leaving it empty
+        Subtree detachTreeHelper() {
+            Subtree tree{rootNode(), blackHeight(rootNode())};
+
+            _head.setParent(nullptr);
+            _head.left = headNode();
+            _head.right = headNode();
+            _size = 0;
+            return tree;
+        }
+
+        // Makes the subtree at root, holding size elements, the tree of the
+        // map, which must be empty
+        void attachTreeHelper(RB_Node* root, size_t size) {
+            if (root == nullptr) {
+                return;
+            }
+
+            root->setColor(Color::Black);
+            root->setParent(headNode());
+            _head.setParent(root);
+
+            RB_Node_Base* leftmost = root;
+            while (leftmost->left) {
+                leftmost = leftmost->left;
+            }
+            RB_Node_Base* rightmost = root;
+            while (rightmost->right) {
+                rightmost = rightmost->right;
+            }
+
+            _head.left = leftmost;
+            _head.right = rightmost;
+            _size = size;
+        }
+
+        // Helper function for joinHelper when left is the higher tree. Walks
+        // down the right spine of the subtree at node to the first black node
+        // as high as right, and puts middle there as a red node with that
+        // node and right as children. A red violation this causes is fixed
+        // by a rotation one black level up, so at most one is left, at the
+        // root. The returned subtree has the same black height as node's
+        RB_Node* joinRightHelper(RB_Node* node, size_t height, RB_Node* middle, RB_Node* right, size_t rightHeight) {
+            if (!isRed(node) && height == rightHeight) {
+                middle->setColor(Color::Red);
+                linkHelper(middle, node, right);
+                return middle;
+            }
+
+            RB_Node* child = joinRightHelper(asNode(node->right), childHeight(node, height), middle, right, rightHeight);
+            linkHelper(node, asNode(node->left), child);
+
+            if (!isRed(node) && isRed(child) && isRed(child->right)) {
+                child->right->setColor(Color::Black);
+                return leftRotation(node);
+            }
+
+            return node;
+        }
+
+        // Mirror image of joinRightHelper, for when right is the higher tree
+        RB_Node* joinLeftHelper(RB_Node* left, size_t leftHeight, RB_Node* middle, RB_Node* node, size_t height) {
+            if (!isRed(node) && height == leftHeight) {
+                middle->setColor(Color::Red);
+                linkHelper(middle, left, node);
+                return middle;
+            }
+
+            RB_Node* child = joinLeftHelper(left, leftHeight, middle, asNode(node->left), childHeight(node, height));
+            linkHelper(node, child, asNode(node->right));
+
+            if (!isRed(node) && isRed(child) && isRed(child->left)) {
+                child->left->setColor(Color::Black);
+                return rightRotation(node);
+            }
+
+            return node;
+        }
+
+        // Joins two subtrees and a node into one red-black subtree in
+        // O(1 + |left.height - right.height|). Every key in left must be
+        // less than middle's, and every key in right greater
+        Subtree joinHelper(Subtree left, RB_Node* middle, Subtree right) {
+            if (isRed(left.root)) {
+                left.root->setColor(Color::Black);
+                left.height++;
+            }
+            if (isRed(right.root)) {
+                right.root->setColor(Color::Black);
+                right.height++;
+            }
+
+            Subtree result;
+            if (left.height > right.height) {
+                result = Subtree{joinRightHelper(left.root, left.height, middle, right.root, right.height), left.height};
+                if (isRed(result.root) && isRed(result.root->right)) {
+                    result.root->setColor(Color::Black);
+                    result.height++;
+                }
+            } else if (right.height > left.height) {
+                result = Subtree{joinLeftHelper(left.root, left.height, middle, right.root, right.height), right.height};
+                if (isRed(result.root) && isRed(result.root->left)) {
+                    result.root->setColor(Color::Black);
+                    result.height++;
+                }
+            } else {
+                middle->setColor(Color::Red);
+                linkHelper(middle, left.root, right.root);
+                result = Subtree{middle, left.height};
+            }
+
+            return result;
+        }
+
+        // Removes the node with the greatest key from a nonempty subtree.
+        // Returns the rest of the subtree and sets last to that node
+        Subtree splitLastHelper(Subtree tree, RB_Node*& last) {
+            RB_Node* node = tree.root;
+            size_t height = childHeight(node, tree.height);
+
+            if (node->right == nullptr) {
+                last = node;
+                return Subtree{asNode(node->left), height};
+            }
+
+            Subtree rest = splitLastHelper(Subtree{asNode(node->right), height}, last);
+            return joinHelper(Subtree{asNode(node->left), height}, node, rest);
+        }
+
+        // Joins two subtrees without a node in between
+        Subtree join2Helper(Subtree left, Subtree right) {
+            if (left.root == nullptr) {
+                return right;
+            }
+            if (right.root == nullptr) {
+                return left;
+            }
+
+            RB_Node* last = nullptr;
+            Subtree rest = splitLastHelper(left, last);
+            return joinHelper(rest, last, right);
+        }
+
+        // Cuts a subtree at key x in O(log n). Each node on the search path
+        // is joined onto the side of x it belongs to, and the joins on each
+        // side get higher as the path goes up, so their costs telescope. All
+        // comparisons come before the first join, so if one throws, the
+        // subtree is left as it was
+        template<typename K>
+        SplitResult splitHelper(Subtree tree, const K& x) {
+            if (tree.root == nullptr) {
+                return SplitResult();
+            }
+
+            RB_Node* node = tree.root;
+            size_t height = childHeight(node, tree.height);
+            Subtree left{asNode(node->left), height};
+            Subtree right{asNode(node->right), height};
+
+            int order;
+            if constexpr (threeWay<K>()) {
+                order = threeWayHelper(x, node->value.first);
+            } else {
+                order = _comp(x, node->value.first) ? -1 : (_comp(node->value.first, x) ? 1 : 0);
+            }
+
+            if (order < 0) {
+                SplitResult result = splitHelper(left, x);
+                result.greater = joinHelper(result.greater, node, right);
+                return result;
+            }
+            if (order > 0) {
+                SplitResult result = splitHelper(right, x);
+                result.less = joinHelper(left, node, result.less);
+                return result;
+            }
+
+            return SplitResult{left, node, right};
+        }
+
+        // Number of elements before pos, a node or the header. Takes
+        // O(log n) with the OrderStatistics augment. Otherwise the elements
+        // are counted from both ends at once, which takes time proportional
+        // to the smaller side of pos
+        size_t countBeforeHelper(RB_Node_Base* pos) const {
+            if constexpr (orderStatistics) {
+                return nodeRank(pos);
+            } else {
+                if (pos == headNode()) {
+                    return _size;
+                }
+
+                RB_Node_Base* front = _head.left;
+                RB_Node_Base* back = _head.right;
+                size_t before = 0;
+                size_t after = 1;   // Elements from back to the end
+
+                while (front != pos && back != pos) {
+                    front = inorderSuccessor(front);
+                    before++;
+                    back = inorderPredecessor(back);
+                    after++;
+                }
+
+                return (front == pos) ? before : _size - after;
+            }
+        }
+
+        // Helper function for split(). Moves the elements with keys less
+        // than x into lower and the others into upper, which must both be
+        // empty, and leaves this map empty
+        template<typename K>
+        void splitMapHelper(const K& x, Map& lower, Map& upper) {
+            size_t lowerSize = countBeforeHelper(lowerBoundHelper(x));
+            size_t size = _size;
+            SplitResult parts = splitHelper(detachTreeHelper(), x);
+
+            if (parts.node) {
+                parts.greater = joinHelper(Subtree(), parts.node, parts.greater);
+            }
+
+            lower.attachTreeHelper(parts.less.root, lowerSize);
+            upper.attachTreeHelper(parts.greater.root, size - lowerSize);
+        }
+
+        // Ranges up to this long are erased element by element, which is
+        // faster than cutting them out of the tree
+        static constexpr size_t eraseRangeCutoff = 32;
+
+        // Helper function for range erase. Erases [first, last), where both
+        // may be the header, and returns the number of elements erased. A
+        // longer range is cut out of the tree with two splits and a join,
+        // which restructure the tree in O(log n), and its nodes are then
+        // freed in one pass. The other nodes are relinked but stay where
+        // they are, so iterators to them remain valid
+        size_t eraseRangeHelper(RB_Node_Base* first, RB_Node_Base* last) {
+            if (first == last) {
+                return 0;
+            }
+
+            // The range is not empty, so first is a node and not the header
+            if (first == _head.left && last == headNode()) {
+                size_t erased = _size;
+                clear();
+                return erased;
+            }
+
+            size_t length = 0;
+            for (RB_Node_Base* node = first; node != last && length <= eraseRangeCutoff; node = inorderSuccessor(node)) {
+                length++;
+            }
+
+            if (length <= eraseRangeCutoff) {
+                for (RB_Node_Base* node = first; node != last;) {
+                    RB_Node_Base* next = inorderSuccessor(node);
+                    eraseHelper(asNode(node));
+                    node = next;
+                }
+                return length;
+            }
+
+            // first ends up as the node of the first split, and last as the
+            // node of the second one
+            size_t size = _size;
+            SplitResult lower = splitHelper(detachTreeHelper(), asNode(first)->value.first);
+            Subtree result;
+            size_t erased = 1;
+
+            if (last == headNode()) {
+                erased += deleteSubtreeHelper(lower.greater.root);
+                result = lower.less;
+            } else {
+                SplitResult upper = splitHelper(lower.greater, asNode(last)->value.first);
+                erased += deleteSubtreeHelper(upper.less.root);
+                result = joinHelper(lower.less, upper.node, upper.greater);
+            }
+            destroyNode(lower.node);
+
+            attachTreeHelper(result.root, size - erased);
+            return erased;
+        }
+
+        ///////////////////////////
+        // SET OPERATION HELPERS //
+        ///////////////////////////
+
+        // Cutting the tree at every key of other costs more than searching
+        // for the keys one by one until other is much smaller. While
+        // m * m <= n, log n <= 2 log(n/m + 1), so searching is within the
+        // bound as well
+        bool fewKeys(const Map& other) const {
+            return other._size == 0 || other._size <= _size / other._size;
+        }
+
+        // Smallest black height at which the set operations hand the two
+        // halves of a split to separate tasks. A subtree of black height h
+        // holds at least 2^h - 1 elements
+        static size_t forkHeight(const parallel_policy& policy) {
+            size_t height = 1;
+            while ((size_t(1) << height) - 1 < policy.grain()) {
+                height++;
+            }
+
+            return height;
+        }
+
+        // Runs f and g on pool if parallel is true, otherwise one after the
+        // other
+        template<typename F, typename G>
+        static void forkHelper(bool parallel, ThreadPool* pool, F&& f, G&& g) {
+            if (parallel) {
+                pool->invoke(f, g);
+            } else {
+                f();
+                g();
+            }
+        }
+
+        // Helper function for union_with. Splits mine at the root key of
+        // theirs and unites the two smaller pairs of subtrees, which is
+        // O(m log(n/m + 1)) overall. Counts the keys found in both. The
+        // subtrees are taken out of mine, parts and the like before a call
+        // that may throw, so if the comparator or combine throws, whatever
+        // this call still owns is freed and nothing is freed twice
+        template<typename Combine>
+        Subtree unionHelper(Subtree mine, Subtree theirs, Combine& combine, size_t& collisions, ThreadPool* pool, size_t minHeight) {
+            if (mine.root == nullptr) {
+                return theirs;
+            }
+            if (theirs.root == nullptr) {
+                return mine;
+            }
+
+            RB_Node* node = theirs.root;
+            size_t height = childHeight(node, theirs.height);
+            Subtree theirsLess{asNode(node->left), height};
+            Subtree theirsGreater{asNode(node->right), height};
+
+            SplitResult parts;
+            Subtree less;
+            Subtree greater;
+            size_t lessCollisions = 0;
+            size_t greaterCollisions = 0;
+
+            try {
+                parts = splitHelper(mine, node->value.first);
+                mine.root = nullptr;
+
+                forkHelper(pool && std::min(mine.height, theirs.height) >= minHeight, pool,
+                    [&] { less = unionHelper(std::exchange(parts.less, Subtree()), std::exchange(theirsLess, Subtree()), combine, lessCollisions, pool, minHeight); },
+                    [&] { greater = unionHelper(std::exchange(parts.greater, Subtree()), std::exchange(theirsGreater, Subtree()), combine, greaterCollisions, pool, minHeight); });
+
+                if (parts.node) {
+                    parts.node->value.second = combine(std::move(parts.node->value.second), std::move(node->value.second));
+                }
+            } catch (...) {
+                for (RB_Node* root : {mine.root, parts.less.root, parts.greater.root, theirsLess.root, theirsGreater.root, less.root, greater.root}) {
+                    deleteSubtreeHelper(root);
+                }
+                if (parts.node) {
+                    destroyNode(parts.node);
+                }
+                destroyNode(node);
+                throw;
+            }
+
+            collisions += lessCollisions + greaterCollisions;
+            if (parts.node) {
+                destroyNode(node);
+                node = parts.node;
+                collisions++;
+            }
+
+            return joinHelper(less, node, greater);
+        }
+
+        // Helper function for intersect_with. Like unionHelper, but the
+        // subtree of other at theirs is only read, and the parts of mine with
+        // no match in it are freed. Counts the elements kept
+        template<typename Combine>
+        Subtree intersectHelper(Subtree mine, const RB_Node* theirs, size_t theirsHeight, Combine& combine, size_t& kept, ThreadPool* pool, size_t minHeight) {
+            if (mine.root == nullptr) {
+                return mine;
+            }
+            if (theirs == nullptr) {
+                deleteSubtreeHelper(mine.root);
+                return Subtree();
+            }
+
+            size_t height = childHeight(theirs, theirsHeight);
+
+            SplitResult parts;
+            Subtree less;
+            Subtree greater;
+            size_t lessKept = 0;
+            size_t greaterKept = 0;
+
+            try {
+                parts = splitHelper(mine, theirs->value.first);
+                mine.root = nullptr;
+
+                forkHelper(pool && std::min(mine.height, theirsHeight) >= minHeight, pool,
+                    [&] { less = intersectHelper(std::exchange(parts.less, Subtree()), asNode(theirs->left), height, combine, lessKept, pool, minHeight); },
+                    [&] { greater = intersectHelper(std::exchange(parts.greater, Subtree()), asNode(theirs->right), height, combine, greaterKept, pool, minHeight); });
+
+                if (parts.node) {
+                    parts.node->value.second = combine(std::move(parts.node->value.second), theirs->value.second);
+                }
+            } catch (...) {
+                for (RB_Node* root : {mine.root, parts.less.root, parts.greater.root, less.root, greater.root}) {
+                    deleteSubtreeHelper(root);
+                }
+                if (parts.node) {
+                    destroyNode(parts.node);
+                }
+                throw;
+            }
+
+            kept += lessKept + greaterKept;
+            if (parts.node) {
+                kept++;
+                return joinHelper(less, parts.node, greater);
+            }
+
+            return join2Helper(less, greater);
+        }
+
+        // Helper function for difference_with. Frees the nodes of mine whose
+        // keys are in the subtree of other at theirs, and counts them. Like
+        // intersectHelper, frees all of mine it still owns if the comparator
+        // throws
+        Subtree differenceHelper(Subtree mine, const RB_Node* theirs, size_t theirsHeight, size_t& removed, ThreadPool* pool, size_t minHeight) {
+            if (mine.root == nullptr || theirs == nullptr) {
+                return mine;
+            }
+
+            size_t height = childHeight(theirs, theirsHeight);
+
+            SplitResult parts;
+            Subtree less;
+            Subtree greater;
+            size_t lessRemoved = 0;
+            size_t greaterRemoved = 0;
+
+            try {
+                parts = splitHelper(mine, theirs->value.first);
+                mine.root = nullptr;
+
+                if (parts.node) {
+                    destroyNode(parts.node);
+                    removed++;
+                }
+
+                forkHelper(pool && std::min(mine.height, theirsHeight) >= minHeight, pool,
+                    [&] { less = differenceHelper(std::exchange(parts.less, Subtree()), asNode(theirs->left), height, lessRemoved, pool, minHeight); },
+                    [&] { greater = differenceHelper(std::exchange(parts.greater, Subtree()), asNode(theirs->right), height, greaterRemoved, pool, minHeight); });
+            } catch (...) {
+                for (RB_Node* root : {mine.root, parts.less.root, parts.greater.root, less.root, greater.root}) {
+                    deleteSubtreeHelper(root);
+                }
+                throw;
+            }
+
+            removed += lessRemoved + greaterRemoved;
+            return join2Helper(less, greater);
+        }
+
+        template<typename Combine>
+        void unionWithHelper(Map& other, Combine& combine, ThreadPool* pool, size_t minHeight) {
+            if (&other == this) {
+                Map copy(other);
+                unionWithHelper(copy, combine, pool, minHeight);
+                return;
+            }
+
+            // Nodes can only change maps if this allocator can free them
+            if (!(_alloc == other._alloc)) {
+                Map copy(other, _alloc);
+                other.clear();
+                unionWithHelper(copy, combine, pool, minHeight);
+                return;
+            }
+
+            if (fewKeys(other)) {
+                RB_Node* spare = other.detachHelper();
+
+                // A node stays on the spare list until it is linked in or
+                // freed, so the comparator or combine throwing leaks nothing
+                try {
+                    while (spare) {
+                        RB_Node* node = spare;
+                        InsertPosition pos = insertPosHelper(node->value.first);
+
+                        if (!pos.exists) {
+                            spare = asNode(node->right);
+                            insertHelper(pos, node);
+                            continue;
+                        }
+
+                        RB_Node* existing = asNode(pos.node);
+                        existing->value.second = combine(std::move(existing->value.second), std::move(node->value.second));
+                        spare = asNode(node->right);
+                        destroyNode(node);
+                        updatePathHelper(existing);
+                    }
+                } catch (...) {
+                    destroySpareHelper(spare);
+                    throw;
+                }
+                return;
+            }
+
+            size_t size = _size + other._size;
+            Subtree mine = detachTreeHelper();
+            Subtree theirs = other.detachTreeHelper();
+            size_t collisions = 0;
+
+            Subtree result = unionHelper(mine, theirs, combine, collisions, pool, minHeight);
+            attachTreeHelper(result.root, size - collisions);
+        }
+
+        template<typename Combine>
+        void intersectWithHelper(const Map& other, Combine& combine, ThreadPool* pool, size_t minHeight) {
+            if (&other == this) {
+                Map copy(other);
+                intersectWithHelper(copy, combine, pool, minHeight);
+                return;
+            }
+
+            const RB_Node* theirs = other.rootNode();
+            Subtree mine = detachTreeHelper();
+            size_t kept = 0;
+
+            Subtree result = intersectHelper(mine, theirs, blackHeight(theirs), combine, kept, pool, minHeight);
+            attachTreeHelper(result.root, kept);
+        }
+
+        void differenceWithHelper(const Map& other, ThreadPool* pool, size_t minHeight) {
+            if (&other == this) {
+                clear();
+                return;
+            }
+
+            if (fewKeys(other)) {
+                for (RB_Node_Base* node = other._head.left; node != other.headNode(); node = other.inorderSuccessor(node)) {
+                    if (RB_Node* found = findHelper(rootNode(), asNode(node)->value.first)) {
+                        eraseHelper(found);
+                    }
+                }
+                return;
+            }
+
+            const RB_Node* theirs = other.rootNode();
+            size_t size = _size;
+            Subtree mine = detachTreeHelper();
+            size_t removed = 0;
+
+            Subtree result = differenceHelper(mine, theirs, blackHeight(theirs), removed, pool, minHeight);
+            attachTreeHelper(result.root, size - removed);
+        }
+
+    public:
+        Map(): _head(), _size(0) {
+            _head.left = headNode();
+            _head.right = headNode();
+        }
+
+        explicit Map(const Allocator& alloc): _head(), _size(0), _alloc(alloc) {
+            _head.left = headNode();
+            _head.right = headNode();
+        }
+
+        template <class InputIter>
+        Map(InputIter first, InputIter last, const Allocator& alloc = Allocator())
+         : _head(), _size(0), _alloc(alloc) {
+            _head.left = headNode();
+            _head.right = headNode();
+
+            // With end() as the hint, each key of a sorted range is appended
+            // after the current maximum without a search from the root
+            while (first != last) {
+                insert(end(), *first);
+                first++;
+            }
+        }
+
+        // Builds the map in O(n) from a range sorted by unique keys. The
+        // range is trusted to be sorted, use assign_sorted to check it
+        template <class InputIter>
+        Map(sorted_unique_t, InputIter first, InputIter last, const Allocator& alloc = Allocator())
+         : _head(), _size(0), _alloc(alloc) {
+            _head.left = headNode();
+            _head.right = headNode();
+
+            buildSortedHelper(first, last, false);
+        }
+
+        // Builds the map from an unsorted range with the threads of policy.
+        // The elements are copied out and merge sorted in parallel, then the
+        // balanced tree is built bottom-up with each half of a subtree built
+        // by a separate task. Like insert, a repeated key keeps the last
+        // value. Nodes are allocated on several threads at once, so the
+        // allocator must be thread-safe, which PoolAllocator is not
+        template <class InputIter>
+        Map(const parallel_policy& policy, InputIter first, InputIter last, const Allocator& alloc = Allocator())
+         : Map(alloc) {
+            std::vector<std::pair<Key, T>> items(first, last);
+            ThreadPool& pool = policy.threads();
+            parallelSortHelper(items.begin(), items.end(), policy.grain(), pool);
+
+            // Keep the last of every run of equal keys
+            size_t n = 0;
+            for (size_t i = 0; i < items.size(); i++) {
+                if (i + 1 < items.size() && !_comp(items[i].first, items[i + 1].first)) {
+                    continue;
+                }
+                if (n != i) {
+                    items[n] = std::move(items[i]);
+                }
+                n++;
+            }
+
+            if (n == 0) {
+                return;
+            }
 
-            // Root must be black
-            if (_head.parent->color != Color::Black) {
-                _head.parent->color = Color::Black;
+            size_t redDepth = 0;
+            while ((size_t(2) << redDepth) - 1 <= n) {
+                redDepth++;
             }
-        }
 
-    public:
-        Map(): _head(), _size(0) {
-            _head.left = &_head;
-            _head.right = &_head;
+            attachTreeHelper(buildParallelHelper(items.data(), n, 0, redDepth, policy.grain(), pool), n);
         }
 
-        template <class InputIter>
-        Map(InputIter first, InputIter last): _head(value_type(), nullptr, &_head, &_head), _size(0) {
-            while (first != last) {
-                insert(*first);
-                first++;
-            }
-        }
+        Map(std::initializer_list<value_type> il, const Allocator& alloc = Allocator())
+         : _head(), _size(0), _alloc(alloc) {
+            _head.left = headNode();
+            _head.right = headNode();
 
-        Map(std::initializer_list<value_type> il): _head(value_type(), nullptr, &_head, &_head), _size(0) {
             for (auto i = il.begin(); i != il.end(); i++) {
-                insert(*i);
+                insert(end(), *i);
             }
         }
 
-        Map(const Map& other): _head(), _size(other._size), _comp(other._comp) {
-            _head.parent = copyHelper(other._head.parent, &other._head);
-            _head.parent->parent = &_head;
-        }
+        Map(const Map& other): Map(other, node_traits::select_on_container_copy_construction(other._alloc)) {}
 
-        Map(Map&& other): _head(), _size(other._size), _comp(other._comp) {
-            _head.parent = other._head.parent;
-            if (_size > 0) {
-                other._head.parent->parent = &_head;
-                _head.left = other._head.left;
-                _head.right = other._head.right;
+        Map(const Map& other, const Allocator& alloc): _head(), _size(other._size), _comp(other._comp), _alloc(alloc) {
+            RB_Node* spare = nullptr;
+            _head.setParent(copyHelper(other.rootNode(), other.headNode(), spare));
+            if (_head.parent()) {
+                _head.parent()->setParent(headNode());
             } else {
-                _head.parent = nullptr;
-                _head.left = &_head;
-                _head.right = &_head;
+                _head.left = headNode();
+                _head.right = headNode();
             }
+        }
 
-            other._head.parent = nullptr;
-            other._head.left = &other._head;
-            other._head.right = &other._head;
-            other._size = 0;
+        Map(Map&& other): _head(), _size(0), _comp(other._comp), _alloc(std::move(other._alloc)) {
+            stealTree(other);
         } 
 
         ~Map() {
@@ -995,15 +2824,38 @@ class Map {
                 return *this;
             }
             
-            if (!empty()) {
-                clear();
+            // Nodes must be freed by the allocator that made them, so they
+            // can only be reused if the allocator stays the same
+            if constexpr (node_traits::propagate_on_container_copy_assignment::value) {
+                if (_alloc != other._alloc) {
+                    clear();
+                }
+                _alloc = other._alloc;
             }
 
-            _head.parent = copyHelper(other._head.parent, &other._head);
-            _head.parent->parent = &_head;
-            _size = other._size;
+            // Reuse the current nodes for the copy, so only the difference
+            // in size is allocated or freed
+            RB_Node* spare = detachHelper();
             _comp = other._comp;
 
+            try {
+                _head.setParent(copyHelper(other.rootNode(), other.headNode(), spare));
+            } catch (...) {
+                // Leave an empty map behind that can still be used
+                destroySpareHelper(spare);
+                _head.setParent(nullptr);
+                _head.left = headNode();
+                _head.right = headNode();
+                _size = 0;
+                throw;
+            }
+            destroySpareHelper(spare);
+
+            if (_head.parent()) {
+                _head.parent()->setParent(headNode());
+            }
+            _size = other._size;
+
             return *this;
         }
 
@@ -1012,45 +2864,59 @@ class Map {
                 return *this;
             }
             
-            if (!empty()) {
-                clear();
-            }
+            clear();
+            _comp = other._comp;
 
-            _head.parent = other._head.parent;
-            if (other._size > 0) {
-                other._head.parent->parent = &_head;
-                _head.left = other._head.left;
-                _head.right = other._head.right;
+            if constexpr (node_traits::propagate_on_container_move_assignment::value) {
+                _alloc = std::move(other._alloc);
+                stealTree(other);
+            } else if (_alloc == other._alloc) {
+                stealTree(other);
             } else {
-                _head.parent = nullptr;
-                _head.left = &_head;
-                _head.right = &_head;
+                // Our allocator cannot free other's nodes, so move the values
+                // into nodes of our own instead
+                for (iterator i = other.begin(); i != other.end(); i++) {
+                    insert(std::move(*i));
+                }
+                other.clear();
             }
-            _size = other._size;
-            _comp = other._comp;
-
-            other._head.parent = nullptr;
-            other._head.left = &other._head;
-            other._head.right = &other._head;
-            other._size = 0;
 
             return *this;
         }
 
         Map& operator=(std::initializer_list<value_type> il) {
-            if (!empty()) {
-                clear();
-            }
-
-            _head.parent = nullptr;
-            _head.left = &_head;
-            _head.right = &_head;
+            assign(il.begin(), il.end());
+            return *this;
+        }
 
-            for (auto i = il.begin(); i != il.end(); i++) {
-                insert(*i);
+        // Replaces the contents with the elements of [first, last), reusing
+        // the current nodes so only the difference in size is allocated or
+        // freed. Like insert, a repeated key keeps the last value. If an
+        // exception is thrown, the map holds the elements assigned so far
+        template <class InputIter>
+        void assign(InputIter first, InputIter last) {
+            RB_Node* spare = detachHelper();
+
+            try {
+                for (; first != last; ++first) {
+                    const auto& val = *first;
+
+                    // The header hints end(), so ascending keys find their
+                    // slot next to the maximum and only others search
+                    InsertPosition pos = insertPosHelper(headNode(), val.first);
+                    if (pos.exists) {
+                        asNode(pos.node)->value.second = val.second;
+                        updatePathHelper(asNode(pos.node));
+                    } else {
+                        insertHelper(pos, reuseOrCreateNode(spare, val));
+                    }
+                }
+            } catch (...) {
+                destroySpareHelper(spare);
+                throw;
             }
 
-            return *this;
+            destroySpareHelper(spare);
         }
 
         // ITERATOR FUNCTIONS
@@ -1063,11 +2929,11 @@ class Map {
         }
 
         iterator end() noexcept {
-            return iterator(&_head);
+            return iterator(headNode());
         }
 
         const_iterator end() const noexcept {
-            return const_iterator(&_head);
+            return const_iterator(headNode());
         }
 
         reverse_iterator rbegin() noexcept {
@@ -1108,67 +2974,36 @@ class Map {
 
         // ELEMENT ACCESS
         mapped_type& operator[] (const key_type& k) {
-            if (!_head.parent) { // Add root if tree is empty
-                _head.parent = new RB_Node({k, mapped_type()});
-                _head.parent->color = Color::Black;
-                _head.right = _head.parent;
-                _head.left = _head.parent;
-                _head.parent->parent = &_head;
-                _size++;
-
-                return _head.parent->value.second;
-
-            } else { // Insert and rebalance
-                std::pair<RB_Node*, bool> temp = insertHelper(_head.parent, {std::move(k), mapped_type()});
-
-                // If there is a new minimum, replace it
-                if (_comp(temp.first->value.first, _head.left->value.first)) {
-                    _head.left = temp.first;
-                }
-
-                // If there is a new maximum, replace it
-                if (_comp(_head.right->value.first, temp.first->value.first)) {
-                    _head.right = temp.first;
-                }
-
-                rebalance();
-
-                return temp.first->value.second;
-            }
+            return tryEmplaceHelper(nullptr, k).first->value.second;
         }
 
         mapped_type& operator[] (key_type&& k) {
-            if (!_head.parent) { // Add root if tree is empty
-                _head.parent = new RB_Node({std::move(k), mapped_type()});
-                _head.parent->color = Color::Black;
-                _head.right = _head.parent;
-                _head.left = _head.parent;
-                _head.parent->parent = &_head;
-                _size++;
-
-                return _head.parent->value.second;
+            return tryEmplaceHelper(nullptr, std::move(k)).first->value.second;
+        }
 
-            } else { // Insert and rebalance
-                std::pair<RB_Node*, bool> temp = insertHelper(_head.parent, {std::move(k), mapped_type()});
+        mapped_type& at (const key_type& k) {
+            RB_Node* x = findHelper(rootNode(), k);
 
-                // If there is a new minimum, replace it
-                if (_comp(temp.first->value.first, _head.left->value.first)) {
-                    _head.left = temp.first;
-                }
+            if (!x) {
+                throw std::out_of_range("Given key is not in map");
+            }
 
-                // If there is a new maximum, replace it
-                if (_comp(_head.right->value.first, temp.first->value.first)) {
-                    _head.right = temp.first;
-                }
+            return x->value.second;
+        }
 
-                rebalance();
+        const mapped_type& at (const key_type& k) const {
+            const RB_Node* x = findHelper(rootNode(), k);
 
-                return temp.first->value.second;
+            if (!x) {
+                throw std::out_of_range("Given key is not in map");
             }
+
+            return x->value.second;
         }
 
-        mapped_type& at (const key_type& k) {
-            RB_Node* x = findHelper(_head.parent, k);
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        mapped_type& at (const K& k) {
+            RB_Node* x = findHelper(rootNode(), k);
 
             if (!x) {
                 throw std::out_of_range("Given key is not in map");
@@ -1177,8 +3012,9 @@ class Map {
             return x->value.second;
         }
 
-        const mapped_type& at (const key_type& k) const {
-            RB_Node* x = findHelper(_head.parent, k);
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const mapped_type& at (const K& k) const {
+            const RB_Node* x = findHelper(rootNode(), k);
 
             if (!x) {
                 throw std::out_of_range("Given key is not in map");
@@ -1188,76 +3024,93 @@ class Map {
         }
 
         // MODIFIER FUNCTIONS
+        // If the key already exists, its value is replaced by val's
         std::pair<iterator,bool> insert (const value_type& val) {
-            if (!_head.parent) { // Add root if tree is empty
-                _head.parent = new RB_Node(val);
-                _head.parent->color = Color::Black;
-                _head.right = _head.parent;
-                _head.left = _head.parent;
-                _head.parent->parent = &_head;
-                _size++;
+            std::pair<RB_Node*, bool> temp = insertOrAssignHelper(nullptr, val.first, val.second);
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-                return std::pair<iterator, bool>(iterator(_head.parent), true);
+        std::pair<iterator,bool> insert (value_type&& val) {
+            std::pair<RB_Node*, bool> temp = insertOrAssignHelper(nullptr, val.first, std::move(val.second));
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-            } else { // Insert and rebalance
-                std::pair<RB_Node*, bool> temp = insertHelper(_head.parent, val);
-                if (!temp.second) {
-                    temp.first->value.second = val.second;
-                }
+        // The hinted variants take the position the new element should go
+        // right before. When the key belongs next to hint, the node is
+        // linked in without a search from the root, so inserting sorted
+        // input with end() (or the previous result) as hint is amortized O(1)
+        iterator insert (const_iterator hint, const value_type& val) {
+            return iterator(insertOrAssignHelper(hint.n, val.first, val.second).first);
+        }
 
-                // If there is a new minimum, replace it
-                if (_comp(temp.first->value.first, _head.left->value.first)) {
-                    _head.left = temp.first;
-                }
+        iterator insert (const_iterator hint, value_type&& val) {
+            return iterator(insertOrAssignHelper(hint.n, val.first, std::move(val.second)).first);
+        }
 
-                // If there is a new maximum, replace it
-                if (_comp(_head.right->value.first, temp.first->value.first)) {
-                    _head.right = temp.first;
-                }
+        // Constructs the value in place from args. If the key already
+        // exists, the new node is destroyed again and nothing is changed
+        template<class... Args>
+        std::pair<iterator,bool> emplace (Args&&... args) {
+            std::pair<RB_Node*, bool> temp = insertNodeHelper(nullptr, createNode(std::forward<Args>(args)...));
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-                rebalance();
+        template<class... Args>
+        iterator emplace_hint (const_iterator hint, Args&&... args) {
+            return iterator(insertNodeHelper(hint.n, createNode(std::forward<Args>(args)...)).first);
+        }
 
-                return std::pair<iterator, bool>(iterator(temp.first), temp.second);
-            }
+        // Constructs the mapped value in place from args only if k does not
+        // exist yet. Nothing is constructed or moved from otherwise
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (const key_type& k, Args&&... args) {
+            std::pair<RB_Node*, bool> temp = tryEmplaceHelper(nullptr, k, std::forward<Args>(args)...);
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
         }
 
-        std::pair<iterator,bool> insert (value_type&& val) {
-            if (!_head.parent) { // Add root if tree is empty
-                _head.parent = new RB_Node(std::move(val));
-                _head.parent->color = Color::Black;
-                _head.right = _head.parent;
-                _head.left = _head.parent;
-                _head.parent->parent = &_head;
-                _size++;
+        template<class... Args>
+        std::pair<iterator,bool> try_emplace (key_type&& k, Args&&... args) {
+            std::pair<RB_Node*, bool> temp = tryEmplaceHelper(nullptr, std::move(k), std::forward<Args>(args)...);
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-                return std::pair<iterator, bool>(iterator(_head.parent), true);
+        template<class... Args>
+        iterator try_emplace (const_iterator hint, const key_type& k, Args&&... args) {
+            return iterator(tryEmplaceHelper(hint.n, k, std::forward<Args>(args)...).first);
+        }
 
-            } else { // Insert and rebalance
-                std::pair<RB_Node*, bool> temp = insertHelper(_head.parent, std::move(val));
-                if (!temp.second) {
-                    temp.first->value.second = std::move(val.second);
-                }
+        template<class... Args>
+        iterator try_emplace (const_iterator hint, key_type&& k, Args&&... args) {
+            return iterator(tryEmplaceHelper(hint.n, std::move(k), std::forward<Args>(args)...).first);
+        }
 
-                // If there is a new minimum, replace it
-                if (_comp(temp.first->value.first, _head.left->value.first)) {
-                    _head.left = temp.first;
-                }
+        // Assigns obj to the value of k if it exists, otherwise inserts it
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (const key_type& k, M&& obj) {
+            std::pair<RB_Node*, bool> temp = insertOrAssignHelper(nullptr, k, std::forward<M>(obj));
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-                // If there is a new maximum, replace it
-                if (_comp(_head.right->value.first, temp.first->value.first)) {
-                    _head.right = temp.first;
-                }
+        template<class M>
+        std::pair<iterator,bool> insert_or_assign (key_type&& k, M&& obj) {
+            std::pair<RB_Node*, bool> temp = insertOrAssignHelper(nullptr, std::move(k), std::forward<M>(obj));
+            return std::pair<iterator, bool>(iterator(temp.first), temp.second);
+        }
 
-                rebalance();
+        template<class M>
+        iterator insert_or_assign (const_iterator hint, const key_type& k, M&& obj) {
+            return iterator(insertOrAssignHelper(hint.n, k, std::forward<M>(obj)).first);
+        }
 
-                return std::pair<iterator, bool>(iterator(temp.first), temp.second);
-            }
+        template<class M>
+        iterator insert_or_assign (const_iterator hint, key_type&& k, M&& obj) {
+            return iterator(insertOrAssignHelper(hint.n, std::move(k), std::forward<M>(obj)).first);
         }
 
         iterator erase(iterator pos ) {
             iterator temp(pos.n);
             temp++;
-            eraseHelper(pos.n, pos->first);
+            eraseHelper(asNode(pos.n));
 
             return temp;
         }
@@ -1265,27 +3118,113 @@ class Map {
         iterator erase(const_iterator pos) {
             iterator temp(pos.n);
             temp++;
-            eraseHelper(pos.n, pos->first);
+            eraseHelper(asNode(pos.n));
 
             return temp;
         }
 
         size_t erase(const key_type& k) {
-            if (eraseHelper(_head.parent, k)) {
+            RB_Node* node = findHelper(rootNode(), k);
+
+            if (node) {
+                eraseHelper(node);
                 return 1;
             } else {
                 return 0;
             }
         }
 
+        // Erases [first, last) in O(log n + k) for k elements
         iterator erase(const_iterator first, const_iterator last) {
-            iterator f(first.n);
-            iterator l(last.n);
-            while (f != l) {
-                f = erase(f);
+            eraseRangeHelper(first.n, last.n);
+            return iterator(last.n);
+        }
+
+        // Erases the elements with keys in [lo, hi) in O(log n + k), and
+        // returns how many there were
+        size_t erase(const key_type& lo, const key_type& hi) {
+            if (!_comp(lo, hi)) {
+                return 0;
+            }
+
+            return eraseRangeHelper(lowerBoundHelper(lo), lowerBoundHelper(hi));
+        }
+
+        // Iterators convert to const_iterator and are left to the overload
+        // above
+        template<class K, class C = Compare, class = typename C::is_transparent,
+                 class = std::enable_if_t<!std::is_convertible<const K&, const_iterator>::value>>
+        size_t erase(const K& lo, const K& hi) {
+            if (!_comp(lo, hi)) {
+                return 0;
+            }
+
+            return eraseRangeHelper(lowerBoundHelper(lo), lowerBoundHelper(hi));
+        }
+
+        // Removes the element at pos from the tree without destroying it
+        node_type extract(const_iterator pos) {
+            RB_Node* node = asNode(pos.n);
+            unlinkHelper(node);
+            return node_type(node, _alloc);
+        }
+
+        // Removes the element with key k, if any, without destroying it
+        node_type extract(const key_type& k) {
+            RB_Node* node = findHelper(rootNode(), k);
+
+            if (!node) {
+                return node_type();
+            }
+
+            unlinkHelper(node);
+            return node_type(node, _alloc);
+        }
+
+        // Links the node owned by nh into the tree, unless its key exists.
+        // nh.get_allocator() must compare equal to get_allocator()
+        insert_return_type insert(node_type&& nh) {
+            return insertHandleHelper(nullptr, std::move(nh));
+        }
+
+        iterator insert(const_iterator hint, node_type&& nh) {
+            return insertHandleHelper(hint.n, std::move(nh)).position;
+        }
+
+        // Moves every element of source whose key is not in this map over
+        // to this map. Nodes are relinked if the allocators compare equal,
+        // otherwise the values are moved into new nodes
+        void merge(Map& source) {
+            if (&source == this) {
+                return;
+            }
+
+            RB_Node_Base* link = source._head.left;
+
+            while (link != source.headNode()) {
+                // Unlinking keeps every other node in place, so the successor
+                // stays valid
+                RB_Node* node = asNode(link);
+                RB_Node_Base* next = source.inorderSuccessor(node);
+                InsertPosition pos = insertPosHelper(node->value.first);
+
+                if (!pos.exists) {
+                    if (_alloc == source._alloc) {
+                        source.unlinkHelper(node);
+                        insertHelper(pos, node);
+                    } else {
+                        RB_Node* copy = createNode(node->value.first, std::move(node->value.second));
+                        insertHelper(pos, copy);
+                        source.eraseHelper(node);
+                    }
+                }
+
+                link = next;
             }
+        }
 
-            return l;
+        void merge(Map&& source) {
+            merge(source);
         }
 
         void swap(Map& x) {
@@ -1296,19 +3235,49 @@ class Map {
 
         // Empties the map
         void clear() {
-            deleteHelper(_head.parent);
-            _head.parent= nullptr;
-            _head.left = &_head;
-            _head.right = &_head;
+            bool released = false;
+
+            if constexpr (has_release<node_allocator>::value) {
+                // Nobody else allocates from the pool, so every node can be
+                // freed in one call instead of one deallocation per node
+                if (_alloc.unique()) {
+                    if constexpr (!std::is_trivially_destructible<RB_Node>::value) {
+                        deleteHelper(rootNode(), false);
+                    }
+                    _alloc.release();
+                    released = true;
+                }
+            }
+
+            if (!released) {
+                deleteHelper(rootNode());
+            }
+            _head.setParent(nullptr);
+            _head.left = headNode();
+            _head.right = headNode();
             _size = 0;
         }
 
+        // Replaces the contents with a range sorted by unique keys in O(n).
+        // If verify is true, std::invalid_argument is thrown when the keys
+        // are not strictly increasing. The map is left empty if anything
+        // throws
+        template <class InputIter>
+        void assign_sorted(InputIter first, InputIter last, bool verify = false) {
+            clear();
+            buildSortedHelper(first, last, verify);
+        }
+
         // OBSERVER FUNCTIONS
         key_compare key_comp() const { return _comp; }
+        allocator_type get_allocator() const { return allocator_type(_alloc); }
 
         // OPERATION FUNCTIONS
+        // The overloads taking a K are only available when Compare declares
+        // is_transparent (like std::less<>). They look up any type the
+        // comparator can compare with key_type without building a key_type
         iterator find(const key_type& k) {
-            RB_Node* temp = findHelper(_head.parent, k);
+            RB_Node* temp = findHelper(rootNode(), k);
 
             if (temp) {
                 return iterator(temp);
@@ -1318,96 +3287,357 @@ class Map {
         }
 
         const_iterator find(const key_type& k) const {
-            RB_Node* temp = findHelper(_head.parent, k);
+            const RB_Node* temp = findHelper(rootNode(), k);
 
             if (temp) {
-                return iterator(temp);
+                return const_iterator(temp);
             }
 
             return end();
         }
 
-        size_t count(const key_type& k) const {
-            return (findHelper(_head.parent, k))? 1: 0;
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator find(const K& k) {
+            RB_Node* temp = findHelper(rootNode(), k);
+
+            if (temp) {
+                return iterator(temp);
+            }
+
+            return end();
         }
 
-        iterator lower_bound(const key_type& k) {
-            RB_Node* temp = boundHelper(_head.parent, k);
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator find(const K& k) const {
+            const RB_Node* temp = findHelper(rootNode(), k);
 
             if (temp) {
-                if (_comp(temp->value.first, k)) {
-                    return ++iterator(temp);
-                } else {
-                    return iterator(temp);
-                }
-            } else {
-                return end();
+                return const_iterator(temp);
             }
+
+            return end();
+        }
+
+        size_t count(const key_type& k) const {
+            return (findHelper(rootNode(), k))? 1: 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t count(const K& k) const {
+            return (findHelper(rootNode(), k))? 1: 0;
+        }
+
+        iterator lower_bound(const key_type& k) {
+            return iterator(lowerBoundHelper(k));
         }
 
         const_iterator lower_bound(const key_type& k) const {
-            RB_Node* temp = boundHelper(_head.parent, k);
+            return const_iterator(lowerBoundHelper(k));
+        }
 
-            if (temp) {
-                if (_comp(temp->value.first, k)) {
-                    return ++const_iterator(temp);
-                } else {
-                    return const_iterator(temp);
-                }
-            } else {
-                return end();
-            }
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator lower_bound(const K& k) {
+            return iterator(lowerBoundHelper(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator lower_bound(const K& k) const {
+            return const_iterator(lowerBoundHelper(k));
         }
 
         iterator upper_bound(const key_type& k) {
-            RB_Node* temp = boundHelper(_head.parent, k);
+            return iterator(upperBoundHelper(k));
+        }
 
-            if (temp) {
-                if (_comp(k, temp->value.first)) {
-                    return --iterator(temp);
-                } else {
-                    return iterator(temp);
-                }
-            } else {
-                return end();
+        const_iterator upper_bound(const key_type& k) const {
+            return const_iterator(upperBoundHelper(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        iterator upper_bound(const K& k) {
+            return iterator(upperBoundHelper(k));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator upper_bound(const K& k) const {
+            return const_iterator(upperBoundHelper(k));
+        }
+
+        std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const {
+            std::pair<RB_Node_Base*, RB_Node_Base*> range = equalRangeHelper(k);
+            return std::pair<const_iterator, const_iterator>(const_iterator(range.first), const_iterator(range.second));
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::pair<const_iterator, const_iterator> equal_range(const K& k) const {
+            std::pair<RB_Node_Base*, RB_Node_Base*> range = equalRangeHelper(k);
+            return std::pair<const_iterator, const_iterator>(const_iterator(range.first), const_iterator(range.second));
+        }
+
+        // Look up a range of keys sorted in the order of the map and write
+        // one iterator per key to out, returning the end of the output. The
+        // tree is descended once for the whole batch, so the nodes near the
+        // root are compared once rather than once per key, and k keys cost
+        // O(k log(n/k + 1)). The keys may be of any type the comparator
+        // accepts together with key_type. Keys that are not sorted give
+        // unspecified results
+
+        // Writes the iterator find would return for every key
+        template<class ForwardIter, class OutputIter>
+        OutputIter find_batch(ForwardIter first, ForwardIter last, OutputIter out) {
+            return batchHelper<iterator>(rootNode(), headNode(), first, last, out, true);
+        }
+
+        template<class ForwardIter, class OutputIter>
+        OutputIter find_batch(ForwardIter first, ForwardIter last, OutputIter out) const {
+            return batchHelper<const_iterator>(rootNode(), headNode(), first, last, out, true);
+        }
+
+        // Writes the iterator lower_bound would return for every key
+        template<class ForwardIter, class OutputIter>
+        OutputIter lower_bound_batch(ForwardIter first, ForwardIter last, OutputIter out) {
+            return batchHelper<iterator>(rootNode(), headNode(), first, last, out, false);
+        }
+
+        template<class ForwardIter, class OutputIter>
+        OutputIter lower_bound_batch(ForwardIter first, ForwardIter last, OutputIter out) const {
+            return batchHelper<const_iterator>(rootNode(), headNode(), first, last, out, false);
+        }
+
+        // Looks up every key of [first, last), in any order, and stores the
+        // iterator find would return for the ith key in results[i]. The
+        // searches are interleaved, with each one prefetching its next node
+        // while the others advance, so on maps much larger than the cache
+        // the lookups wait for memory together rather than one at a time
+        template<class ForwardIter, class RandomIter>
+        void find_many(ForwardIter first, ForwardIter last, RandomIter results) {
+            findManyHelper<iterator>(first, last, results);
+        }
+
+        template<class ForwardIter, class RandomIter>
+        void find_many(ForwardIter first, ForwardIter last, RandomIter results) const {
+            findManyHelper<const_iterator>(first, last, results);
+        }
+
+        // ORDER STATISTICS FUNCTIONS
+        // Only available with the OrderStatistics augment. Each takes O(log n)
+
+        // Iterator to the element with k elements before it, or end() if k
+        // is not less than size()
+        iterator select(size_t k) {
+            return iterator(selectHelper(k));
+        }
+
+        const_iterator select(size_t k) const {
+            return const_iterator(selectHelper(k));
+        }
+
+        // Number of elements with a key less than k
+        size_t rank(const key_type& k) const {
+            return rankHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t rank(const K& k) const {
+            return rankHelper(k);
+        }
+
+        // Number of elements with a key in [lo, hi)
+        size_t count_range(const key_type& lo, const key_type& hi) const {
+            size_t end = rankHelper(hi);
+            size_t begin = rankHelper(lo);
+            return end > begin ? end - begin : 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t count_range(const K& lo, const K& hi) const {
+            size_t end = rankHelper(hi);
+            size_t begin = rankHelper(lo);
+            return end > begin ? end - begin : 0;
+        }
+
+        // AGGREGATE FUNCTIONS
+        // Only available with an Aggregate augment. Combines the mapped
+        // values of the keys in [lo, hi) in key order, in O(log n)
+        aggregate_type aggregate(const key_type& lo, const key_type& hi) const {
+            return aggregateHelper(lo, hi);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        aggregate_type aggregate(const K& lo, const K& hi) const {
+            return aggregateHelper(lo, hi);
+        }
+
+        // The map cannot see a mapped value being changed through a
+        // reference, such as one from operator[], at() or an iterator.
+        // After such a change, refresh(pos) recomputes the cached data that
+        // depends on the value at pos in O(log n)
+        void refresh(const_iterator pos) {
+            updatePathHelper(asNode(pos.n));
+        }
+
+        // PARALLEL FUNCTIONS
+        // Run on the threads of policy, e.g. m.for_each(par, f), splitting
+        // the tree by subtree. Nothing may insert into or erase from the map
+        // while they run
+
+        // Calls f(value_type&) once for every element, from several threads
+        // at once and in no particular order. Changing a value this way
+        // leaves cached Aggregate data stale, as described for refresh()
+        template<class F>
+        void for_each(const parallel_policy& policy, F f) {
+            if (_head.parent()) {
+                forEachHelper(rootNode(), f, splitDepth(policy), policy.threads());
             }
         }
 
-        const_iterator upper_bound(const key_type& k) const {
-            RB_Node* temp = boundHelper(_head.parent, k);
+        // Calls f(const value_type&) like the non-const for_each
+        template<class F>
+        void for_each(const parallel_policy& policy, F f) const {
+            if (_head.parent()) {
+                forEachHelper(static_cast<const RB_Node*>(rootNode()), f, splitDepth(policy), policy.threads());
+            }
+        }
 
-            if (temp) {
-                if (_comp(k, temp->value.first)) {
-                    return --const_iterator(temp);
-                } else {
-                    return const_iterator(temp);
-                }
-            } else {
-                return end();
+        // Returns init combined by op with transform(value) of every element,
+        // in key order but grouped arbitrarily. op(U, U) must be associative
+        // and, like transform, callable from several threads at once
+        template<class U, class Reduce, class Transform>
+        U transform_reduce(const parallel_policy& policy, U init, Reduce op, Transform transform) const {
+            if (_head.parent() == nullptr) {
+                return init;
             }
+
+            return op(std::move(init), reduceHelper<U>(rootNode(), op, transform, splitDepth(policy), policy.threads()));
         }
 
-        std::pair<const_iterator, const_iterator> equal_range(const key_type& k) const {
-            const RB_Node* temp = boundHelper(_head.parent, k);
-            std::pair<const_iterator, const_iterator> p;
+        // transform_reduce over the mapped values, e.g. the sum of all
+        // values is m.reduce(par, 0, std::plus<>())
+        template<class U, class Reduce>
+        U reduce(const parallel_policy& policy, U init, Reduce op) const {
+            return transform_reduce(policy, std::move(init), op, [](const value_type& v) -> const T& { return v.second; });
+        }
 
-            if (temp) {
-                if (_comp(temp->value.first, k)) {
-                    p.first = ++const_iterator(temp);
-                    p.second = p.first;
-                } else if (_comp(k, temp->value.first)) {
-                    p.first = const_iterator(temp);
-                    p.second = const_iterator(temp);
-                } else {
-                    p.first = const_iterator(temp);
-                    p.second = ++const_iterator(temp);
-                }
-            } else {
-                p.first = cend();
-                p.second = cend();
+        // SPLIT AND JOIN FUNCTIONS
+        // Move elements between maps by relinking their nodes, restoring
+        // the red-black properties along a single path. The tree work takes
+        // O(log n). Without the OrderStatistics augment, split also walks
+        // the elements on the smaller side of k to know the new sizes, which
+        // takes linear time
+
+        // Returns a map with the elements whose keys are less than k and one
+        // with the rest, and leaves this map empty. Takes O(log n) with the
+        // OrderStatistics augment. Otherwise counting the smaller side takes
+        // O(min(m, n - m)) for m elements less than k, so splitting a large
+        // map near its middle is linear
+        std::pair<Map, Map> split(const key_type& k) {
+            std::pair<Map, Map> result(std::piecewise_construct, std::forward_as_tuple(_alloc), std::forward_as_tuple(_alloc));
+            result.first._comp = _comp;
+            result.second._comp = _comp;
+            splitMapHelper(k, result.first, result.second);
+            return result;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        std::pair<Map, Map> split(const K& k) {
+            std::pair<Map, Map> result(std::piecewise_construct, std::forward_as_tuple(_alloc), std::forward_as_tuple(_alloc));
+            result.first._comp = _comp;
+            result.second._comp = _comp;
+            splitMapHelper(k, result.first, result.second);
+            return result;
+        }
+
+        // Returns a map with the elements of lower and upper, leaving both
+        // empty. Every key of lower must be less than every key of upper,
+        // or std::invalid_argument is thrown and neither map changes. The
+        // nodes of upper are moved into new ones if the allocators of the
+        // two maps do not compare equal, which takes O(n)
+        static Map join(Map&& lower, Map&& upper) {
+            if (!lower.empty() && !upper.empty() && !lower._comp(asNode(lower._head.right)->value.first, asNode(upper._head.left)->value.first)) {
+                throw std::invalid_argument("Keys of lower are not all less than keys of upper");
+            }
+
+            Map result(std::move(lower));
+            if (!(result._alloc == upper._alloc)) {
+                Map copy(result._alloc);
+                copy._comp = upper._comp;
+                copy.buildSortedHelper(std::make_move_iterator(upper.begin()), std::make_move_iterator(upper.end()), false);
+                upper.clear();
+                return join(std::move(result), std::move(copy));
+            }
+
+            if (upper.empty()) {
+                return result;
+            }
+            if (result.empty()) {
+                result.stealTree(upper);
+                return result;
             }
 
-            return p;
+            size_t size = result._size + upper._size;
+            RB_Node* last = nullptr;
+            Subtree rest = result.splitLastHelper(result.detachTreeHelper(), last);
+            Subtree tree = result.joinHelper(rest, last, upper.detachTreeHelper());
+            result.attachTreeHelper(tree.root, size);
+            return result;
+        }
+
+        // SET FUNCTIONS
+        // Combine this map with other in O(m log(n/m + 1)) for sizes m <= n,
+        // by cutting one tree at the keys of the other and joining the
+        // pieces back together. Adding a small map to a large one takes
+        // about m log n, two maps of similar size take linear time. The
+        // overloads taking a policy unite, intersect or subtract the two
+        // halves of every cut in separate tasks while both are larger than
+        // the grain, which needs a thread-safe allocator and a combine that
+        // can be called from several threads at once. If combine or the
+        // comparator throws, the maps are left valid and no node leaks, but
+        // which elements they hold is unspecified
+
+        // Moves every element of other into this map, leaving other empty.
+        // For a key in both, the value becomes combine(own, theirs), both
+        // passed as rvalues; by default this map's value is kept. Nodes are
+        // relinked without allocating when the allocators compare equal
+        template<class Combine = KeepOwn>
+        void union_with(Map& other, Combine combine = Combine()) {
+            unionWithHelper(other, combine, nullptr, 0);
+        }
+
+        template<class Combine = KeepOwn>
+        void union_with(Map&& other, Combine combine = Combine()) {
+            unionWithHelper(other, combine, nullptr, 0);
+        }
+
+        template<class Combine = KeepOwn>
+        void union_with(const parallel_policy& policy, Map& other, Combine combine = Combine()) {
+            unionWithHelper(other, combine, &policy.threads(), forkHeight(policy));
+        }
+
+        template<class Combine = KeepOwn>
+        void union_with(const parallel_policy& policy, Map&& other, Combine combine = Combine()) {
+            unionWithHelper(other, combine, &policy.threads(), forkHeight(policy));
+        }
+
+        // Erases every element whose key is not in other. For the others
+        // the value becomes combine(own, theirs), with own as an rvalue and
+        // theirs as a const lvalue; by default this map's value is kept
+        template<class Combine = KeepOwn>
+        void intersect_with(const Map& other, Combine combine = Combine()) {
+            intersectWithHelper(other, combine, nullptr, 0);
+        }
+
+        template<class Combine = KeepOwn>
+        void intersect_with(const parallel_policy& policy, const Map& other, Combine combine = Combine()) {
+            intersectWithHelper(other, combine, &policy.threads(), forkHeight(policy));
+        }
+
+        // Erases every element whose key is in other
+        void difference_with(const Map& other) {
+            differenceWithHelper(other, nullptr, 0);
+        }
+
+        void difference_with(const parallel_policy& policy, const Map& other) {
+            differenceWithHelper(other, &policy.threads(), forkHeight(policy));
         }
 };
 
@@ -0,0 +1,803 @@
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include "Map.h"            // ThreeWayCompare
+#include <algorithm>        // std::copy
+#include <atomic>           // std::atomic
+#include <cstddef>          // size_t, ptrdiff_t
+#include <functional>       // std::less
+#include <initializer_list> // initializer_list
+#include <iterator>         // forward iterator tag
+#include <memory>           // std::allocator, std::allocator_traits
+#include <stdexcept>        // std::out_of_range
+#include <tuple>            // std::forward_as_tuple
+#include <utility>          // std::move, std::forward, std::pair
+#include <vector>           // std::vector
+
+// Immutable version of a PersistentMap, returned by PersistentMap::snapshot().
+// It shares its nodes with the map and with other snapshots, so taking and
+// copying one is O(1). Nothing a later write does to the map changes it.
+//
+// A snapshot can be read from any number of threads without a lock. Nodes are
+// reference counted, and the last snapshot or map to let go of a node frees
+// it on its own thread, so Allocator must be safe to use from several threads
+// at once (std::allocator is, PoolAllocator is not)
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>>
+class PersistentSnapshot {
+    protected:
+        struct Node;
+
+    public:
+        using key_type        = Key;
+        using mapped_type     = T;
+        using value_type      = std::pair<const Key, T>;
+        using key_compare     = Compare;
+        using allocator_type  = Allocator;
+        using size_type       = size_t;
+        using reference       = const value_type&;
+        using const_reference = const value_type&;
+
+        // Forward iterator over the elements in key order. Without parent
+        // links, it keeps the nodes still to be visited on a stack
+        class const_iterator {
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type        = std::pair<const Key, T>;
+                using difference_type   = std::ptrdiff_t;
+                using pointer           = const value_type*;
+                using reference         = const value_type&;
+
+                const_iterator(): _depth(0) {}
+
+                // Only the used part of the stack is copied
+                const_iterator(const const_iterator& other): _depth(other._depth) {
+                    std::copy(other._stack, other._stack + _depth, _stack);
+                }
+
+                const_iterator& operator=(const const_iterator& other) {
+                    _depth = other._depth;
+                    std::copy(other._stack, other._stack + _depth, _stack);
+                    return *this;
+                }
+
+                reference operator*() const { return _stack[_depth - 1]->value; }
+                pointer operator->() const { return &_stack[_depth - 1]->value; }
+
+                const_iterator& operator++() {
+                    const Node* node = _stack[--_depth];
+                    pushLeft(node->right);
+                    return *this;
+                }
+
+                const_iterator operator++(int) {
+                    const_iterator temp = *this;
+                    ++(*this);
+                    return temp;
+                }
+
+                bool operator==(const const_iterator& other) const { return current() == other.current(); }
+                bool operator!=(const const_iterator& other) const { return current() != other.current(); }
+
+            private:
+                friend class PersistentSnapshot;
+
+                // The height of a left-leaning red-black tree is at most twice
+                // the base-2 logarithm of its size, which keeps any tree that
+                // fits in memory below this
+                static constexpr size_t maxHeight = 128;
+
+                const Node* current() const {
+                    return _depth ? _stack[_depth - 1] : nullptr;
+                }
+
+                // Pushes node and the left spine below it, leaving the
+                // smallest of them on top
+                void pushLeft(const Node* node) {
+                    while (node) {
+                        _stack[_depth++] = node;
+                        node = node->left;
+                    }
+                }
+
+                const Node* _stack[maxHeight];
+                size_t _depth;
+        };
+
+        using iterator = const_iterator;
+
+        PersistentSnapshot(): _root(nullptr), _size(0) {}
+        explicit PersistentSnapshot(const Allocator& alloc): _root(nullptr), _size(0), _alloc(alloc) {}
+
+        PersistentSnapshot(const PersistentSnapshot& other)
+         : _root(retain(other._root)), _size(other._size), _comp(other._comp), _alloc(other._alloc) {}
+
+        PersistentSnapshot(PersistentSnapshot&& other) noexcept
+         : _root(other._root), _size(other._size), _comp(other._comp), _alloc(other._alloc) {
+            other._root = nullptr;
+            other._size = 0;
+        }
+
+        PersistentSnapshot& operator=(const PersistentSnapshot& other) {
+            Node* root = retain(other._root);
+            releaseHelper(_root);
+
+            _root = root;
+            _size = other._size;
+            _comp = other._comp;
+            _alloc = other._alloc;
+            return *this;
+        }
+
+        PersistentSnapshot& operator=(PersistentSnapshot&& other) noexcept {
+            if (this != &other) {
+                releaseHelper(_root);
+
+                _root = other._root;
+                _size = other._size;
+                _comp = other._comp;
+                _alloc = other._alloc;
+                other._root = nullptr;
+                other._size = 0;
+            }
+
+            return *this;
+        }
+
+        ~PersistentSnapshot() {
+            releaseHelper(_root);
+        }
+
+        // ITERATOR FUNCTIONS
+        const_iterator begin() const {
+            const_iterator i;
+            i.pushLeft(_root);
+            return i;
+        }
+
+        const_iterator end() const { return const_iterator(); }
+        const_iterator cbegin() const { return begin(); }
+        const_iterator cend() const { return end(); }
+
+        // CAPACITY FUNCTIONS
+        bool empty() const noexcept { return _size == 0; }
+        size_t size() const noexcept { return _size; }
+
+        // OBSERVER FUNCTIONS
+        key_compare key_comp() const { return _comp; }
+        allocator_type get_allocator() const { return allocator_type(_alloc); }
+
+        // LOOKUP FUNCTIONS
+        // The overloads taking a K are only available when Compare declares
+        // is_transparent, as in Map
+        const_iterator find(const key_type& k) const {
+            return findHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator find(const K& k) const {
+            return findHelper(k);
+        }
+
+        size_t count(const key_type& k) const {
+            return nodeHelper(k) ? 1 : 0;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        size_t count(const K& k) const {
+            return nodeHelper(k) ? 1 : 0;
+        }
+
+        bool contains(const key_type& k) const {
+            return nodeHelper(k) != nullptr;
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        bool contains(const K& k) const {
+            return nodeHelper(k) != nullptr;
+        }
+
+        const mapped_type& at(const key_type& k) const {
+            return atHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const mapped_type& at(const K& k) const {
+            return atHelper(k);
+        }
+
+        // First element whose key is not less than k
+        const_iterator lower_bound(const key_type& k) const {
+            return lowerBoundHelper(k);
+        }
+
+        template<class K, class C = Compare, class = typename C::is_transparent>
+        const_iterator lower_bound(const K& k) const {
+            return lowerBoundHelper(k);
+        }
+
+    protected:
+        // Tree node. refs counts the links to the node from parents, maps and
+        // snapshots. Nodes reachable from a map or snapshot are never changed
+        // again, apart from refs. A write builds its changed nodes next to
+        // them and marks those fresh until it is done
+        struct Node {
+            std::atomic<unsigned> refs;
+            bool red;
+            bool fresh;
+            Node* left;
+            Node* right;
+            value_type value;
+
+            // Constructs the value in place from args. The node starts out
+            // red with no children and one reference
+            template<typename... Args>
+            explicit Node(Args&&... args)
+             : refs(1), red(true), fresh(true), left(nullptr), right(nullptr), value(std::forward<Args>(args)...) {}
+        };
+
+        using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+        using node_traits    = std::allocator_traits<node_allocator>;
+
+        //////////////////////
+        // HELPER FUNCTIONS //
+        //////////////////////
+
+        static Node* retain(Node* node) {
+            if (node) {
+                node->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            return node;
+        }
+
+        // Drops one reference to node, and frees it together with every
+        // descendant that loses its last reference along with it
+        void releaseHelper(Node* node) {
+            while (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                releaseHelper(node->left);
+                Node* right = node->right;
+                destroyNode(node);
+                node = right;
+            }
+        }
+
+        void destroyNode(Node* node) {
+            node_traits::destroy(_alloc, node);
+            node_traits::deallocate(_alloc, node, 1);
+        }
+
+        // Searches make one key comparison per level, as in Map
+        template<class K>
+        const Node* nodeHelper(const K& x) const {
+            const Node* node = _root;
+
+            if constexpr (ThreeWayCompare<Compare, Key>::template enabled<K>()) {
+                while (node) {
+                    int order = ThreeWayCompare<Compare, Key>::compare(x, node->value.first);
+
+                    if (order < 0) {
+                        node = node->left;
+                    } else if (order > 0) {
+                        node = node->right;
+                    } else {
+                        return node;
+                    }
+                }
+
+                return nullptr;
+            } else {
+                const Node* candidate = nullptr;
+
+                while (node) {
+                    if (_comp(node->value.first, x)) {
+                        node = node->right;
+                    } else {
+                        candidate = node;
+                        node = node->left;
+                    }
+                }
+
+                if (candidate && !_comp(x, candidate->value.first)) {
+                    return candidate;
+                }
+
+                return nullptr;
+            }
+        }
+
+        template<class K>
+        const mapped_type& atHelper(const K& x) const {
+            const Node* node = nodeHelper(x);
+
+            if (!node) {
+                throw std::out_of_range("Given key is not in map");
+            }
+
+            return node->value.second;
+        }
+
+        // The nodes passed on the way down to the lower bound whose left
+        // subtree was entered are exactly the ones an in-order walk from
+        // there has yet to visit
+        template<class K>
+        const_iterator lowerBoundHelper(const K& x) const {
+            const_iterator i;
+            const Node* node = _root;
+
+            while (node) {
+                if (_comp(node->value.first, x)) {
+                    node = node->right;
+                } else {
+                    i._stack[i._depth++] = node;
+                    node = node->left;
+                }
+            }
+
+            return i;
+        }
+
+        // Like lowerBoundHelper, but stops at a node holding x when the keys
+        // compare three ways
+        template<class K>
+        const_iterator findHelper(const K& x) const {
+            const_iterator i;
+
+            if constexpr (ThreeWayCompare<Compare, Key>::template enabled<K>()) {
+                const Node* node = _root;
+
+                while (node) {
+                    int order = ThreeWayCompare<Compare, Key>::compare(x, node->value.first);
+
+                    if (order == 0) {
+                        i._stack[i._depth++] = node;
+                        return i;
+                    }
+
+                    // A node is still to be visited if x is in its left subtree
+                    i._stack[i._depth] = node;
+                    i._depth += (order < 0);
+                    node = (order < 0) ? node->left : node->right;
+                }
+
+                i._depth = 0;
+            } else {
+                i = lowerBoundHelper(x);
+
+                if (i._depth != 0 && _comp(x, i->first)) {
+                    i._depth = 0;
+                }
+            }
+
+            return i;
+        }
+
+        Node* _root;
+        size_t _size;
+        Compare _comp;
+        node_allocator _alloc;
+};
+
+// Map whose versions share structure. A write copies only the nodes on the
+// path from the root to the changed element, and snapshot() returns the
+// current version in O(1), to be read on other threads while this map keeps
+// changing. The map itself is meant for one writer thread at a time.
+//
+// The tree is a left-leaning red-black tree, whose insert and erase work
+// recursively on the search path and need no parent links, which could not
+// be shared between versions. Writes give the strong exception guarantee:
+// the new version is only swapped in once it is complete
+template<class Key, class T, class Compare = std::less<Key>, class Allocator = std::allocator<std::pair<const Key, T>>>
+class PersistentMap : public PersistentSnapshot<Key, T, Compare, Allocator> {
+    private:
+        using Base = PersistentSnapshot<Key, T, Compare, Allocator>;
+        using Node = typename Base::Node;
+        using node_traits = typename Base::node_traits;
+
+        using Base::_root;
+        using Base::_size;
+        using Base::_comp;
+        using Base::_alloc;
+
+    public:
+        using typename Base::key_type;
+        using typename Base::mapped_type;
+        using typename Base::value_type;
+        using typename Base::const_iterator;
+        using snapshot_type = Base;
+
+        PersistentMap() = default;
+        explicit PersistentMap(const Allocator& alloc): Base(alloc) {}
+
+        template <class InputIter>
+        PersistentMap(InputIter first, InputIter last, const Allocator& alloc = Allocator()): Base(alloc) {
+            while (first != last) {
+                insert_or_assign(first->first, first->second);
+                first++;
+            }
+        }
+
+        PersistentMap(std::initializer_list<value_type> il, const Allocator& alloc = Allocator())
+         : PersistentMap(il.begin(), il.end(), alloc) {}
+
+        // Copies share every node, so they are O(1) like snapshot()
+        PersistentMap(const PersistentMap& other): Base(other) {}
+        PersistentMap(PersistentMap&& other) noexcept: Base(std::move(other)) {}
+
+        PersistentMap& operator=(const PersistentMap& other) {
+            Base::operator=(other);
+            return *this;
+        }
+
+        PersistentMap& operator=(PersistentMap&& other) noexcept {
+            Base::operator=(std::move(other));
+            return *this;
+        }
+
+        // The current version, which later writes to this map leave alone
+        snapshot_type snapshot() const {
+            return snapshot_type(*this);
+        }
+
+        // MODIFIER FUNCTIONS
+        // Returns true if k was inserted, false if its value was assigned
+        template<class M>
+        bool insert_or_assign(const key_type& k, M&& obj) {
+            bool inserted = writeHelper([&](Node*& root) {
+                return insertHelper(root, k, std::forward<M>(obj));
+            });
+
+            _size += inserted;
+            return inserted;
+        }
+
+        template<class M>
+        bool insert_or_assign(key_type&& k, M&& obj) {
+            bool inserted = writeHelper([&](Node*& root) {
+                return insertHelper(root, std::move(k), std::forward<M>(obj));
+            });
+
+            _size += inserted;
+            return inserted;
+        }
+
+        // Inserts k with a value constructed from args if k doesn't exist.
+        // Returns true if it was inserted
+        template<class... Args>
+        bool try_emplace(const key_type& k, Args&&... args) {
+            if (this->nodeHelper(k)) {
+                return false;
+            }
+
+            writeHelper([&](Node*& root) {
+                return insertHelper(root, k, std::forward<Args>(args)...);
+            });
+
+            _size++;
+            return true;
+        }
+
+        size_t erase(const key_type& k) {
+            if (!this->nodeHelper(k)) {
+                return 0;
+            }
+
+            writeHelper([&](Node*& root) {
+                if (!isRed(root->left) && !isRed(root->right)) {
+                    mut(root)->red = true;
+                }
+
+                eraseHelper(root, k);
+                return false;
+            });
+
+            _size--;
+            return 1;
+        }
+
+        void clear() {
+            this->releaseHelper(_root);
+            _root = nullptr;
+            _size = 0;
+        }
+
+        void swap(PersistentMap& x) {
+            std::swap(_root, x._root);
+            std::swap(_size, x._size);
+            std::swap(_comp, x._comp);
+            std::swap(_alloc, x._alloc);
+        }
+
+    private:
+        // Nodes created by the write in progress. They can be changed in
+        // place, and are freed again if the write throws
+        std::vector<Node*> _fresh;
+
+        //////////////////////
+        // HELPER FUNCTIONS //
+        //////////////////////
+
+        static bool isRed(const Node* node) {
+            return node && node->red;
+        }
+
+        template<typename... Args>
+        Node* createNode(Args&&... args) {
+            Node* node = node_traits::allocate(_alloc, 1);
+
+            try {
+                node_traits::construct(_alloc, node, std::forward<Args>(args)...);
+            } catch (...) {
+                node_traits::deallocate(_alloc, node, 1);
+                throw;
+            }
+
+            // The node is built by now, so it must be destroyed as well
+            try {
+                _fresh.push_back(node);
+            } catch (...) {
+                Base::destroyNode(node);
+                throw;
+            }
+
+            return node;
+        }
+
+        // Makes the node at link safe to change. A fresh node is returned as
+        // it is. Any other node may be shared with a snapshot, so it is
+        // replaced at link by a fresh copy that shares its children
+        Node* mut(Node*& link) {
+            if (!link->fresh) {
+                Node* copy = createNode(link->value);
+                copy->red = link->red;
+                copy->left = Base::retain(link->left);
+                copy->right = Base::retain(link->right);
+
+                // link held one reference and a fresh node holds another, so
+                // the old node cannot be freed here
+                link->refs.fetch_sub(1, std::memory_order_relaxed);
+                link = copy;
+            }
+
+            return link;
+        }
+
+        // Takes a node out of the tree for good. A fresh node has had its
+        // children moved elsewhere, and is freed when the write finishes
+        void dropNode(Node* node) {
+            if (node->fresh) {
+                node->refs.store(0, std::memory_order_relaxed);
+            } else {
+                this->releaseHelper(node);
+            }
+        }
+
+        // Runs op on a new reference to the root and returns its result. If op
+        // finishes, the tree it leaves becomes the current version and the
+        // old one is released. If op throws, every fresh node is freed and
+        // the current version is kept
+        template<class Op>
+        bool writeHelper(Op op) {
+            Node* root = Base::retain(_root);
+            bool result = false;
+
+            try {
+                result = op(root);
+            } catch (...) {
+                abortHelper(root);
+                throw;
+            }
+
+            if (root) {
+                root->red = false;
+            }
+
+            for (Node* node : _fresh) {
+                if (node->refs.load(std::memory_order_relaxed) == 0) {
+                    Base::destroyNode(node);
+                } else {
+                    node->fresh = false;
+                }
+            }
+            _fresh.clear();
+
+            this->releaseHelper(_root);
+            _root = root;
+            return result;
+        }
+
+        // Helper function for writeHelper. Every link from a fresh node, and
+        // root, holds a reference that has to be dropped
+        void abortHelper(Node* root) {
+            for (Node* node : _fresh) {
+                if (node->left && !node->left->fresh) {
+                    this->releaseHelper(node->left);
+                }
+                if (node->right && !node->right->fresh) {
+                    this->releaseHelper(node->right);
+                }
+            }
+
+            if (root && !root->fresh) {
+                this->releaseHelper(root);
+            }
+
+            for (Node* node : _fresh) {
+                Base::destroyNode(node);
+            }
+            _fresh.clear();
+        }
+
+        /////////////////////////
+        // REBALANCING HELPERS //
+        /////////////////////////
+
+        // The usual left-leaning red-black rotations and color flip, applied
+        // to fresh nodes. Whatever else they change is made fresh first
+        Node* rotateLeft(Node* h) {
+            Node* x = mut(h->right);
+            h->right = x->left;
+            x->left = h;
+            x->red = h->red;
+            h->red = true;
+            return x;
+        }
+
+        Node* rotateRight(Node* h) {
+            Node* x = mut(h->left);
+            h->left = x->right;
+            x->right = h;
+            x->red = h->red;
+            h->red = true;
+            return x;
+        }
+
+        void flipColors(Node* h) {
+            h->red = !h->red;
+
+            Node* left = mut(h->left);
+            left->red = !left->red;
+
+            Node* right = mut(h->right);
+            right->red = !right->red;
+        }
+
+        // Restores the left-leaning invariants at h on the way back up
+        void balance(Node*& h) {
+            if (isRed(h->right) && !isRed(h->left)) {
+                h = rotateLeft(h);
+            }
+            if (isRed(h->left) && isRed(h->left->left)) {
+                h = rotateRight(h);
+            }
+            if (isRed(h->left) && isRed(h->right)) {
+                flipColors(h);
+            }
+        }
+
+        // Makes h->left or one of its children red before descending left
+        void moveRedLeft(Node*& h) {
+            flipColors(h);
+
+            if (isRed(h->right->left)) {
+                h->right = rotateRight(h->right);
+                h = rotateLeft(h);
+                flipColors(h);
+            }
+        }
+
+        // Makes h->right or one of its children red before descending right
+        void moveRedRight(Node*& h) {
+            flipColors(h);
+
+            if (isRed(h->left->left)) {
+                h = rotateRight(h);
+                flipColors(h);
+            }
+        }
+
+        //////////////////////
+        // INSERT AND ERASE //
+        //////////////////////
+
+        // Inserts k into the subtree at link, or assigns the value when
+        // args is one value and k exists. Returns true if k was inserted
+        template<class KeyArg, class... Args>
+        bool insertHelper(Node*& link, KeyArg&& k, Args&&... args) {
+            if (link == nullptr) {
+                link = createNode(std::piecewise_construct,
+                                  std::forward_as_tuple(std::forward<KeyArg>(k)),
+                                  std::forward_as_tuple(std::forward<Args>(args)...));
+                return true;
+            }
+
+            Node* h = mut(link);
+            bool inserted;
+
+            if (_comp(k, h->value.first)) {
+                inserted = insertHelper(h->left, std::forward<KeyArg>(k), std::forward<Args>(args)...);
+            } else if (_comp(h->value.first, k)) {
+                inserted = insertHelper(h->right, std::forward<KeyArg>(k), std::forward<Args>(args)...);
+            } else {
+                if constexpr (sizeof...(Args) == 1) {
+                    h->value.second = (std::forward<Args>(args), ...);
+                }
+                return false;
+            }
+
+            balance(link);
+            return inserted;
+        }
+
+        // Removes the smallest node of the subtree at link and hands the
+        // reference to it over through min
+        void eraseMinHelper(Node*& link, Node*& min) {
+            if (link->left == nullptr) {
+                min = link;
+                link = nullptr;
+                return;
+            }
+
+            Node* h = mut(link);
+            if (!isRed(h->left) && !isRed(h->left->left)) {
+                moveRedLeft(link);
+            }
+
+            eraseMinHelper(link->left, min);
+            balance(link);
+        }
+
+        // Removes k, which must exist, from the subtree at link
+        void eraseHelper(Node*& link, const key_type& k) {
+            mut(link);
+
+            if (_comp(k, link->value.first)) {
+                if (!isRed(link->left) && !isRed(link->left->left)) {
+                    moveRedLeft(link);
+                }
+                eraseHelper(link->left, k);
+            } else {
+                if (isRed(link->left)) {
+                    link = rotateRight(link);
+                }
+
+                if (!_comp(link->value.first, k) && link->right == nullptr) {
+                    dropNode(link);
+                    link = nullptr;
+                    return;
+                }
+
+                if (!isRed(link->right) && !isRed(link->right->left)) {
+                    moveRedRight(link);
+                }
+
+                if (!_comp(link->value.first, k)) {
+                    // The key is const, so the node is replaced by a copy of
+                    // its successor, made before anything is unlinked
+                    const Node* next = link->right;
+                    while (next->left) {
+                        next = next->left;
+                    }
+
+                    Node* replacement = createNode(next->value);
+                    Node* min = nullptr;
+                    eraseMinHelper(link->right, min);
+                    dropNode(min);
+
+                    Node* h = link;
+                    replacement->red = h->red;
+                    replacement->left = h->left;
+                    replacement->right = h->right;
+                    h->left = nullptr;
+                    h->right = nullptr;
+                    dropNode(h);
+                    link = replacement;
+                } else {
+                    eraseHelper(link->right, k);
+                }
+            }
+
+            balance(link);
+        }
+};
+
+#endif
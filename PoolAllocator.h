@@ -0,0 +1,195 @@
+#ifndef POOL_ALLOCATOR_H
+#define POOL_ALLOCATOR_H
+
+#include <cstddef>          // size_t, max_align_t
+#include <memory>           // std::shared_ptr
+#include <new>              // operator new, bad_alloc
+#include <type_traits>      // true_type, false_type
+
+// Hands out fixed-size slots carved from large contiguous slabs. The slot size
+// is fixed by the first single-object allocation, so a pool is meant to serve
+// one node type (every rebound copy of a PoolAllocator shares the same pool).
+// Freed slots go onto a free list and are reused before a new slab is taken.
+class NodePool {
+    public:
+        NodePool() noexcept
+         : _slotSize(0), _nextSlabSlots(firstSlabSlots), _slabs(nullptr), _free(nullptr), _bump(nullptr), _bumpEnd(nullptr) {}
+
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+
+        ~NodePool() {
+            release();
+        }
+
+        // Returns true if a single object of the given size and alignment
+        // is served from the slabs (everything else goes to operator new)
+        bool fits(size_t size, size_t align) noexcept {
+            if (align > alignof(std::max_align_t)) {
+                return false;
+            }
+
+            if (_slotSize == 0) {
+                _slotSize = roundUp(size < sizeof(FreeSlot) ? sizeof(FreeSlot) : size);
+            }
+
+            return roundUp(size < sizeof(FreeSlot) ? sizeof(FreeSlot) : size) == _slotSize;
+        }
+
+        void* allocate() {
+            if (_free) {
+                FreeSlot* slot = _free;
+                _free = slot->next;
+                return slot;
+            }
+
+            if (_bump == _bumpEnd) {
+                addSlab();
+            }
+
+            void* slot = _bump;
+            _bump += _slotSize;
+            return slot;
+        }
+
+        void deallocate(void* p) noexcept {
+            FreeSlot* slot = static_cast<FreeSlot*>(p);
+            slot->next = _free;
+            _free = slot;
+        }
+
+        // Frees every slab at once. Any slot still handed out becomes invalid.
+        // The slab size is kept, so a pool that is refilled to the same size
+        // goes straight back to large slabs
+        void release() noexcept {
+            while (_slabs) {
+                Slab* next = _slabs->next;
+                ::operator delete(_slabs);
+                _slabs = next;
+            }
+
+            _free = nullptr;
+            _bump = nullptr;
+            _bumpEnd = nullptr;
+        }
+
+    private:
+        // Slabs start small and double until they reach maxSlabBytes
+        static constexpr size_t firstSlabSlots = 64;
+        static constexpr size_t maxSlabBytes = size_t(1) << 20;
+
+        // Header at the start of every slab, used to free them in release()
+        struct Slab {
+            Slab* next;
+        };
+
+        // Freed slots are threaded through their own storage
+        struct FreeSlot {
+            FreeSlot* next;
+        };
+
+        static size_t roundUp(size_t size) noexcept {
+            const size_t align = alignof(std::max_align_t);
+            return (size + align - 1) / align * align;
+        }
+
+        void addSlab() {
+            size_t header = roundUp(sizeof(Slab));
+            char* memory = static_cast<char*>(::operator new(header + _nextSlabSlots * _slotSize));
+
+            Slab* slab = reinterpret_cast<Slab*>(memory);
+            slab->next = _slabs;
+            _slabs = slab;
+
+            _bump = memory + header;
+            _bumpEnd = _bump + _nextSlabSlots * _slotSize;
+
+            if (_nextSlabSlots * _slotSize * 2 <= maxSlabBytes) {
+                _nextSlabSlots *= 2;
+            }
+        }
+
+        size_t _slotSize;
+        size_t _nextSlabSlots;
+        Slab* _slabs;
+        FreeSlot* _free;
+        char* _bump;
+        char* _bumpEnd;
+};
+
+// Allocator that serves single-object allocations (such as Map nodes) from a
+// NodePool. Copies and rebound copies share the pool and compare equal, while
+// a copied container gets a fresh pool of its own.
+//
+// Map frees all of its nodes with a single release() call on clear() and
+// ~Map() when its allocator is the only one referring to the pool (unique())
+template<typename T>
+class PoolAllocator {
+    public:
+        using value_type                             = T;
+        using propagate_on_container_copy_assignment = std::false_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap            = std::true_type;
+        using is_always_equal                        = std::false_type;
+
+        PoolAllocator(): _pool(std::make_shared<NodePool>()) {}
+        PoolAllocator(const PoolAllocator&) noexcept = default;
+        PoolAllocator(PoolAllocator&&) noexcept = default;
+        PoolAllocator& operator=(const PoolAllocator&) noexcept = default;
+        PoolAllocator& operator=(PoolAllocator&&) noexcept = default;
+
+        template<typename U>
+        PoolAllocator(const PoolAllocator<U>& other) noexcept: _pool(other._pool) {}
+
+        // Containers copied from one another do not share a pool
+        PoolAllocator select_on_container_copy_construction() const {
+            return PoolAllocator();
+        }
+
+        T* allocate(size_t n) {
+            // A moved-from allocator gets a new pool on its next allocation
+            if (!_pool) {
+                _pool = std::make_shared<NodePool>();
+            }
+
+            if (n == 1 && _pool->fits(sizeof(T), alignof(T))) {
+                return static_cast<T*>(_pool->allocate());
+            }
+
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, size_t n) noexcept {
+            if (n == 1 && _pool->fits(sizeof(T), alignof(T))) {
+                _pool->deallocate(p);
+            } else {
+                ::operator delete(p);
+            }
+        }
+
+        // True if no other allocator shares this pool, so release() can only
+        // free memory handed out through this allocator
+        bool unique() const noexcept {
+            return _pool.use_count() == 1;
+        }
+
+        // Frees every slab of the pool in one go
+        void release() noexcept {
+            if (_pool) {
+                _pool->release();
+            }
+        }
+
+        template<typename U>
+        bool operator==(const PoolAllocator<U>& other) const noexcept { return _pool == other._pool; }
+        template<typename U>
+        bool operator!=(const PoolAllocator<U>& other) const noexcept { return _pool != other._pool; }
+
+    private:
+        template<typename U>
+        friend class PoolAllocator;
+
+        std::shared_ptr<NodePool> _pool;
+};
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>        // std::max
+#include <atomic>           // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <cstddef>          // size_t
+#include <deque>            // std::deque
+#include <exception>        // std::exception_ptr
+#include <memory>           // std::unique_ptr
+#include <mutex>            // std::mutex, std::lock_guard
+#include <thread>           // std::thread
+#include <utility>          // std::forward
+#include <vector>           // std::vector
+
+// Work-stealing thread pool for fork-join parallelism. invoke(f, g) offers g
+// to other threads and runs f itself, then runs g too if nobody took it.
+// Every thread keeps its own queue: it pushes and pops new tasks at the back,
+// so it works depth first on its own part of the problem, while idle threads
+// steal from the front, where the oldest and largest tasks are. A thread that
+// waits for a stolen task runs other tasks meanwhile, so nested invokes never
+// block the pool.
+//
+// A pool of n threads starts n - 1 workers. The thread calling invoke from
+// outside the pool is the nth while it waits
+class ThreadPool {
+    public:
+        explicit ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()))
+         : _stop(false), _pending(0), _sleepers(0) {
+            threads = std::max(1u, threads);
+
+            // Queue 0 belongs to threads outside the pool
+            for (unsigned i = 0; i < threads; i++) {
+                _queues.emplace_back(new Queue());
+            }
+
+            try {
+                for (unsigned i = 1; i < threads; i++) {
+                    _threads.emplace_back([this, i] { workerLoop(i); });
+                }
+            } catch (...) {
+                shutdown();
+                throw;
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        // Waits for the workers to finish their current task
+        ~ThreadPool() {
+            shutdown();
+        }
+
+        // Number of threads that run tasks, counting the caller of invoke
+        unsigned size() const noexcept {
+            return static_cast<unsigned>(_threads.size() + 1);
+        }
+
+        // Runs f() and g(), possibly at the same time, and returns when both
+        // are done. If either throws, the exception is rethrown once both are
+        // done, the one from f if both throw
+        template<class F, class G>
+        void invoke(F&& f, G&& g) {
+            if (_threads.empty()) {
+                std::forward<F>(f)();
+                std::forward<G>(g)();
+                return;
+            }
+
+            JoinTask<G> join(g);
+            Queue& queue = *_queues[currentQueue()];
+            push(queue, Task{&JoinTask<G>::run, &join});
+
+            std::exception_ptr error;
+            try {
+                std::forward<F>(f)();
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            // Tasks pushed by f were all popped again before it returned, so
+            // g is at the back unless it was stolen
+            if (popIf(queue, &join)) {
+                JoinTask<G>::run(&join);
+            }
+            while (!join.done.load(std::memory_order_acquire)) {
+                if (!runOne(currentQueue())) {
+                    std::this_thread::yield();
+                }
+            }
+
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            if (join.error) {
+                std::rethrow_exception(join.error);
+            }
+        }
+
+        // Pool used by the parallel algorithms when no other is given, with
+        // one thread per hardware thread
+        static ThreadPool& shared() {
+            static ThreadPool pool;
+            return pool;
+        }
+
+    private:
+        struct Task {
+            void (*run)(void*);
+            void* data;
+        };
+
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        // The half of an invoke that may run on another thread. It lives on
+        // the stack of the invoking thread, which waits for done
+        template<class G>
+        struct JoinTask {
+            G& g;
+            std::exception_ptr error;
+            std::atomic<bool> done;
+
+            explicit JoinTask(G& fn): g(fn), done(false) {}
+
+            static void run(void* data) {
+                JoinTask* self = static_cast<JoinTask*>(data);
+
+                try {
+                    self->g();
+                } catch (...) {
+                    self->error = std::current_exception();
+                }
+                self->done.store(true, std::memory_order_release);
+            }
+        };
+
+        std::vector<std::unique_ptr<Queue>> _queues;
+        std::vector<std::thread> _threads;
+        std::atomic<bool> _stop;
+        std::atomic<size_t> _pending;   // Tasks in all queues
+        std::atomic<size_t> _sleepers;  // Workers waiting on _wake
+        std::mutex _sleepMutex;
+        std::condition_variable _wake;
+
+        // The pool and queue of the current thread, if it is a worker
+        inline static thread_local ThreadPool* _currentPool = nullptr;
+        inline static thread_local size_t _currentIndex = 0;
+
+        //////////////////////
+        // HELPER FUNCTIONS //
+        //////////////////////
+
+        size_t currentQueue() const noexcept {
+            return (_currentPool == this) ? _currentIndex : 0;
+        }
+
+        void push(Queue& queue, Task task) {
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.push_back(task);
+            }
+
+            // Either a worker about to sleep sees the new task, or this sees
+            // the worker and wakes it
+            _pending.fetch_add(1);
+            if (_sleepers.load() > 0) {
+                std::lock_guard<std::mutex> lock(_sleepMutex);
+                _wake.notify_one();
+            }
+        }
+
+        // Pops the task with the given data from the back of queue, if it
+        // is still there
+        bool popIf(Queue& queue, void* data) {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (queue.tasks.empty() || queue.tasks.back().data != data) {
+                return false;
+            }
+
+            queue.tasks.pop_back();
+            _pending.fetch_sub(1);
+            return true;
+        }
+
+        // Runs one task, from the back of the own queue if it has one, or
+        // else stolen from the front of another. Returns false if every
+        // queue was empty
+        bool runOne(size_t self) {
+            Task task;
+
+            if (takeTask(self, task)) {
+                task.run(task.data);
+                return true;
+            }
+
+            return false;
+        }
+
+        bool takeTask(size_t self, Task& task) {
+            {
+                Queue& own = *_queues[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+
+                if (!own.tasks.empty()) {
+                    task = own.tasks.back();
+                    own.tasks.pop_back();
+                    _pending.fetch_sub(1);
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < _queues.size(); i++) {
+                Queue& victim = *_queues[(self + i) % _queues.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+
+                if (!victim.tasks.empty()) {
+                    task = victim.tasks.front();
+                    victim.tasks.pop_front();
+                    _pending.fetch_sub(1);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void workerLoop(size_t index) {
+            _currentPool = this;
+            _currentIndex = index;
+
+            while (!_stop.load()) {
+                if (runOne(index)) {
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(_sleepMutex);
+                _sleepers.fetch_add(1);
+                _wake.wait(lock, [this] { return _stop.load() || _pending.load() > 0; });
+                _sleepers.fetch_sub(1);
+            }
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> lock(_sleepMutex);
+                _stop.store(true);
+            }
+            _wake.notify_all();
+
+            for (std::thread& t : _threads) {
+                t.join();
+            }
+            _threads.clear();
+        }
+};
+
+// Execution policy for the parallel algorithms of Map, in the style of
+// std::execution::par. Pass par to run on ThreadPool::shared(), or
+// par.on(pool) for another pool. Work is not split below grain elements.
+// The fields are only set through on and with_grain, which keeps the
+// grain at least 1
+class parallel_policy {
+    public:
+        parallel_policy on(ThreadPool& p) const {
+            parallel_policy result = *this;
+            result._pool = &p;
+            return result;
+        }
+
+        parallel_policy with_grain(size_t g) const {
+            parallel_policy result = *this;
+            result._grain = std::max<size_t>(1, g);
+            return result;
+        }
+
+        ThreadPool& threads() const {
+            return _pool ? *_pool : ThreadPool::shared();
+        }
+
+        size_t grain() const {
+            return _grain;
+        }
+
+    private:
+        ThreadPool* _pool = nullptr;
+        size_t _grain = 4096;
+};
+
+inline constexpr parallel_policy par{};
+
+#endif
@@ -0,0 +1,1368 @@
+#include "Map.h"
+#include "BTreeMap.h"
+#include "ConcurrentMap.h"
+#include "FlatMap.h"
+#include "PersistentMap.h"
+#include "PoolAllocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Build with: g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+// Run all benchmarks with ./benchmark, or pass benchmark names to run a subset
+
+using Clock = std::chrono::steady_clock;
+
+// Nanoseconds elapsed since start
+static double elapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Keeps the optimizer from discarding a computed result
+template<typename T>
+static void doNotOptimize(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Allocations made by the current thread through operator new. operator
+// delete is kept out of line, or GCC warns about free being passed
+// pointers from operator new
+static thread_local size_t allocationCount = 0;
+
+void* operator new(size_t size) {
+    allocationCount++;
+
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+static std::vector<int> shuffledKeys(size_t n, unsigned seed) {
+    std::vector<int> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = static_cast<int>(i);
+    }
+
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(seed));
+    return keys;
+}
+
+// Cost of one insert as the map grows. With an O(log n) insert the time per
+// insert only grows by a constant amount each time the size doubles
+static void insertScaling() {
+    std::cout << "insert_scaling" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 22); n <<= 2) {
+        std::vector<int> keys = shuffledKeys(n, 1);
+        Map<int, int> m;
+
+        Clock::time_point start = Clock::now();
+        for (int k : keys) {
+            m.insert({k, k});
+        }
+        double ns = elapsedNs(start);
+
+        doNotOptimize(m.size());
+        std::cout << "  n=" << n << " ns/insert=" << ns / n << std::endl;
+    }
+}
+
+// Fill a map with shuffled keys and clear it again, once through the
+// default allocator and once through a PoolAllocator
+template<typename MapType>
+static double fillAndClear(const std::vector<int>& keys, int rounds) {
+    MapType m;
+
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (int k : keys) {
+            m.insert({k, k});
+        }
+        doNotOptimize(m.size());
+        m.clear();
+    }
+
+    return elapsedNs(start) / (double(rounds) * keys.size());
+}
+
+static void allocator() {
+    using PoolMap = Map<int, int, std::less<int>, PoolAllocator<std::pair<const int, int>>>;
+
+    std::cout << "allocator" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 2);
+        int rounds = static_cast<int>((1 << 22) / n);
+
+        std::cout << "  n=" << n
+                  << " std::allocator ns/insert=" << fillAndClear<Map<int, int>>(keys, rounds)
+                  << " PoolAllocator ns/insert=" << fillAndClear<PoolMap>(keys, rounds) << std::endl;
+    }
+}
+
+// Throughput of successful lookups of shuffled keys
+static void findThroughput() {
+    std::cout << "find" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 3);
+        Map<int, int> m;
+        for (int k : keys) {
+            m.insert({k, k});
+        }
+
+        std::vector<int> probes = shuffledKeys(n, 4);
+        size_t rounds = (1 << 22) / n;
+        long long sum = 0;
+
+        Clock::time_point start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (int k : probes) {
+                sum += m.find(k)->second;
+            }
+        }
+        double ns = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n << " ns/find=" << ns / (rounds * n) << std::endl;
+    }
+}
+
+// Sorted keys with every 16th key swapped with a random nearby one
+static std::vector<int> nearlySortedKeys(size_t n, unsigned seed) {
+    std::vector<int> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = static_cast<int>(i);
+    }
+
+    std::mt19937 rng(seed);
+    for (size_t i = 0; i + 64 < n; i += 16) {
+        std::swap(keys[i], keys[i + rng() % 64]);
+    }
+    return keys;
+}
+
+// Inserts keys one by one, either without a hint or with the position
+// right after the previously inserted element as hint
+static double insertKeys(const std::vector<int>& keys, bool hinted) {
+    Map<int, int> m;
+
+    Clock::time_point start = Clock::now();
+    if (hinted) {
+        Map<int, int>::iterator hint = m.end();
+        for (int k : keys) {
+            hint = m.insert(hint, {k, k});
+            ++hint;
+        }
+    } else {
+        for (int k : keys) {
+            m.insert({k, k});
+        }
+    }
+    double ns = elapsedNs(start);
+
+    doNotOptimize(m.size());
+    return ns / keys.size();
+}
+
+// Sorted and nearly sorted input, with and without a position hint
+static void hintedInsert() {
+    std::cout << "hinted_insert" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> sorted = shuffledKeys(n, 0);
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<int> nearly = nearlySortedKeys(n, 5);
+
+        std::cout << "  n=" << n
+                  << " sorted ns/insert=" << insertKeys(sorted, false)
+                  << " sorted+hint ns/insert=" << insertKeys(sorted, true)
+                  << " nearly_sorted ns/insert=" << insertKeys(nearly, false)
+                  << " nearly_sorted+hint ns/insert=" << insertKeys(nearly, true) << std::endl;
+    }
+}
+
+// Building a map from a sorted range element by element, through the
+// range constructor (which hints end()) and through the sorted_unique
+// constructor, which links a balanced tree in O(n)
+static void sortedBuild() {
+    std::cout << "sorted_build" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 22); n <<= 4) {
+        std::vector<std::pair<int, int>> values(n);
+        for (size_t i = 0; i < n; i++) {
+            values[i] = {static_cast<int>(i), static_cast<int>(i)};
+        }
+
+        Clock::time_point start = Clock::now();
+        {
+            Map<int, int> m;
+            for (const std::pair<int, int>& v : values) {
+                m.insert(v);
+            }
+            doNotOptimize(m.size());
+        }
+        double insertNs = elapsedNs(start);
+
+        start = Clock::now();
+        {
+            Map<int, int> m(values.begin(), values.end());
+            doNotOptimize(m.size());
+        }
+        double rangeNs = elapsedNs(start);
+
+        start = Clock::now();
+        {
+            Map<int, int> m(sorted_unique, values.begin(), values.end());
+            doNotOptimize(m.size());
+        }
+        double sortedNs = elapsedNs(start);
+
+        std::cout << "  n=" << n
+                  << " insert ns/element=" << insertNs / n
+                  << " range ns/element=" << rangeNs / n
+                  << " sorted_unique ns/element=" << sortedNs / n << std::endl;
+    }
+}
+
+// Refreshing a map from a master copy of the same size. Copy assignment
+// reuses the nodes of the target, clearing it first forces new ones
+static void copyAssign() {
+    std::cout << "copy_assign" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 6);
+        Map<int, int> master;
+        Map<int, int> target;
+        for (int k : keys) {
+            master.insert({k, k});
+            target.insert({k, -k});
+        }
+
+        int rounds = static_cast<int>((1 << 22) / n);
+
+        Clock::time_point start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            target.clear();
+            target = master;
+            doNotOptimize(target.size());
+        }
+        double clearNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            target = master;
+            doNotOptimize(target.size());
+        }
+        double reuseNs = elapsedNs(start);
+
+        std::cout << "  n=" << n
+                  << " clear+assign ns/element=" << clearNs / (double(rounds) * n)
+                  << " assign ns/element=" << reuseNs / (double(rounds) * n) << std::endl;
+    }
+}
+
+// Percentile queries by walking iterators versus select() on a map with
+// the OrderStatistics augment, and what keeping subtree sizes costs insert
+static void orderStatistics() {
+    using RankedMap = Map<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, OrderStatistics>;
+
+    std::cout << "order_statistics" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 7);
+
+        Clock::time_point start = Clock::now();
+        Map<int, int> plain;
+        for (int k : keys) {
+            plain.insert({k, k});
+        }
+        double plainInsertNs = elapsedNs(start);
+
+        start = Clock::now();
+        RankedMap ranked;
+        for (int k : keys) {
+            ranked.insert({k, k});
+        }
+        double rankedInsertNs = elapsedNs(start);
+
+        // The 1st to 99th percentile, walked to from begin()
+        long long sum = 0;
+        start = Clock::now();
+        for (size_t p = 1; p < 100; p++) {
+            Map<int, int>::iterator i = plain.begin();
+            std::advance(i, n * p / 100);
+            sum += i->first;
+        }
+        double walkNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (size_t p = 1; p < 100; p++) {
+            sum += ranked.select(n * p / 100)->first;
+        }
+        double selectNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n
+                  << " insert ns/insert=" << plainInsertNs / n
+                  << " OrderStatistics ns/insert=" << rankedInsertNs / n
+                  << " advance ns/query=" << walkNs / 99
+                  << " select ns/query=" << selectNs / 99 << std::endl;
+    }
+}
+
+// Sum of the mapped values over a random key range, by iterating the range
+// versus aggregate() on a map with a summing Aggregate augment
+static void rangeAggregate() {
+    using SumMap = Map<int, long long, std::less<int>, std::allocator<std::pair<const int, long long>>, Aggregate<SumMonoid<long long>>>;
+
+    std::cout << "aggregate" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 8);
+        Map<int, long long> plain;
+        SumMap summed;
+        for (int k : keys) {
+            plain.insert({k, k});
+            summed.insert({k, k});
+        }
+
+        std::mt19937 rng(9);
+        std::vector<std::pair<int, int>> ranges(1000);
+        for (std::pair<int, int>& r : ranges) {
+            int a = static_cast<int>(rng() % n);
+            int b = static_cast<int>(rng() % n);
+            r = {std::min(a, b), std::max(a, b)};
+        }
+
+        long long sum = 0;
+        Clock::time_point start = Clock::now();
+        for (const std::pair<int, int>& r : ranges) {
+            for (auto i = plain.lower_bound(r.first); i != plain.end() && i->first < r.second; i++) {
+                sum += i->second;
+            }
+        }
+        double iterateNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (const std::pair<int, int>& r : ranges) {
+            sum += summed.aggregate(r.first, r.second);
+        }
+        double aggregateNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n
+                  << " iterate ns/query=" << iterateNs / ranges.size()
+                  << " aggregate ns/query=" << aggregateNs / ranges.size() << std::endl;
+    }
+}
+
+// Long std::string keys sharing a common prefix, so every comparison has to
+// look at most of the string
+static std::vector<std::string> stringKeys(size_t n, unsigned seed) {
+    std::vector<int> ids = shuffledKeys(n, seed);
+    std::vector<std::string> keys;
+    keys.reserve(n);
+
+    for (int id : ids) {
+        std::string digits = std::to_string(id);
+        keys.push_back("/service/region/cluster/session/" + std::string(10 - digits.size(), '0') + digits);
+    }
+    return keys;
+}
+
+// Inserting and finding long std::string keys, where the cost of a
+// descent is dominated by the number of key comparisons per level
+static void stringKeysBenchmark() {
+    std::cout << "string_keys" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<std::string> keys = stringKeys(n, 10);
+        std::vector<std::string> probes = stringKeys(n, 11);
+        Map<std::string, int> m;
+
+        Clock::time_point start = Clock::now();
+        for (const std::string& k : keys) {
+            m.insert({k, 0});
+        }
+        double insertNs = elapsedNs(start);
+
+        size_t rounds = (1 << 22) / n;
+        long long sum = 0;
+
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (const std::string& k : probes) {
+                sum += m.find(k)->second;
+            }
+        }
+        double findNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n
+                  << " ns/insert=" << insertNs / n
+                  << " ns/find=" << findNs / (rounds * n) << std::endl;
+    }
+}
+
+// Runs body(t) on threads 0 to threads - 1 at once and returns the wall time
+template<typename F>
+static double runThreads(unsigned threads, F body) {
+    std::vector<std::thread> pool;
+    Clock::time_point start = Clock::now();
+
+    for (unsigned t = 0; t < threads; t++) {
+        pool.emplace_back(body, t);
+    }
+    for (std::thread& th : pool) {
+        th.join();
+    }
+
+    return elapsedNs(start);
+}
+
+// Lookups from a growing number of reader threads, each doing the same
+// amount of work. A ConcurrentMap lets the readers run side by side, while
+// a Map behind one std::mutex lets only one of them search at a time
+static void concurrentReads() {
+    const size_t n = 1 << 20;
+    const size_t findsPerThread = 1 << 21;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+
+    std::cout << "concurrent_reads (" << cores << " cores)" << std::endl;
+
+    std::vector<int> keys = shuffledKeys(n, 12);
+    ConcurrentMap<int, int> shared;
+    Map<int, int> locked;
+    std::mutex mutex;
+
+    ConcurrentMap<int, int>::batch b;
+    for (int k : keys) {
+        b.insert_or_assign(k, k);
+        locked.insert({k, k});
+    }
+    shared.apply_batch(std::move(b));
+
+    for (unsigned threads = 1; threads <= std::max(4u, cores); threads *= 2) {
+        std::vector<long long> sums(threads);
+
+        double sharedNs = runThreads(threads, [&](unsigned t) {
+            std::mt19937 rng(t);
+            long long sum = 0;
+            for (size_t i = 0; i < findsPerThread; i++) {
+                sum += *shared.find(static_cast<int>(rng() % n));
+            }
+            sums[t] = sum;
+        });
+
+        double mutexNs = runThreads(threads, [&](unsigned t) {
+            std::mt19937 rng(t);
+            long long sum = 0;
+            for (size_t i = 0; i < findsPerThread; i++) {
+                int k = static_cast<int>(rng() % n);
+                std::lock_guard<std::mutex> lock(mutex);
+                sum += locked.find(k)->second;
+            }
+            sums[t] += sum;
+        });
+
+        doNotOptimize(sums);
+        double finds = double(threads) * findsPerThread;
+        std::cout << "  threads=" << threads
+                  << " ConcurrentMap Mfinds/s=" << finds / sharedNs * 1000
+                  << " std::mutex Mfinds/s=" << finds / mutexNs * 1000 << std::endl;
+    }
+}
+
+// Writes of shuffled keys while reader threads keep the map busy, first
+// with one exclusive lock per insert, then in batches that each take the
+// lock once. Each time the writer takes the lock it has to wait for the
+// readers to let go of it, so fewer, longer writes get more done
+template<typename Write>
+static double writeUnderReaders(ConcurrentMap<int, int>& m, unsigned readers, Write write) {
+    std::atomic<bool> done(false);
+    std::vector<std::thread> pool;
+
+    for (unsigned t = 0; t < readers; t++) {
+        pool.emplace_back([&m, &done, t] {
+            std::mt19937 rng(t);
+            long long sum = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                sum += m.find(static_cast<int>(rng() % (1 << 20))).value_or(0);
+            }
+            doNotOptimize(sum);
+        });
+    }
+
+    Clock::time_point start = Clock::now();
+    write();
+    double ns = elapsedNs(start);
+
+    done = true;
+    for (std::thread& th : pool) {
+        th.join();
+    }
+    return ns;
+}
+
+static void batchedWrites() {
+    const size_t batchSize = 256;
+    unsigned readers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+    std::cout << "batched_writes (" << readers << " readers)" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 13);
+
+        ConcurrentMap<int, int> single;
+        double singleNs = writeUnderReaders(single, readers, [&] {
+            for (int k : keys) {
+                single.insert_or_assign(k, k);
+            }
+        });
+
+        ConcurrentMap<int, int> batched;
+        double batchedNs = writeUnderReaders(batched, readers, [&] {
+            for (size_t i = 0; i < n; i += batchSize) {
+                ConcurrentMap<int, int>::batch b;
+                b.reserve(batchSize);
+                for (size_t j = i; j < std::min(n, i + batchSize); j++) {
+                    b.insert_or_assign(keys[j], keys[j]);
+                }
+                batched.apply_batch(std::move(b));
+            }
+        });
+
+        doNotOptimize(single.size() + batched.size());
+        std::cout << "  n=" << n
+                  << " insert_or_assign ns/insert=" << singleNs / n
+                  << " apply_batch ns/insert=" << batchedNs / n << std::endl;
+    }
+}
+
+// Taking a consistent copy for a reader: copying a Map against an O(1)
+// PersistentMap snapshot, and what the shared structure costs writes and
+// lookups in exchange
+static void persistentSnapshots() {
+    std::cout << "persistent" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 14);
+        Map<int, int> m;
+        PersistentMap<int, int> pm;
+
+        Clock::time_point start = Clock::now();
+        for (int k : keys) {
+            m.insert({k, k});
+        }
+        double mapInsertNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int k : keys) {
+            pm.insert_or_assign(k, k);
+        }
+        double persistentInsertNs = elapsedNs(start);
+
+        const int copies = 16;
+        start = Clock::now();
+        for (int i = 0; i < copies; i++) {
+            Map<int, int> copy(m);
+            doNotOptimize(copy.size());
+        }
+        double copyNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int i = 0; i < copies; i++) {
+            PersistentMap<int, int>::snapshot_type snap = pm.snapshot();
+            doNotOptimize(snap.size());
+        }
+        double snapshotNs = elapsedNs(start);
+
+        // Writes while a snapshot is held copy their whole path
+        PersistentMap<int, int>::snapshot_type held = pm.snapshot();
+        start = Clock::now();
+        for (int k : keys) {
+            pm.insert_or_assign(k, -k);
+        }
+        double sharedWriteNs = elapsedNs(start);
+
+        long long sum = 0;
+        start = Clock::now();
+        for (int k : keys) {
+            sum += held.find(k)->second;
+        }
+        double findNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n
+                  << " Map ns/insert=" << mapInsertNs / n
+                  << " PersistentMap ns/insert=" << persistentInsertNs / n
+                  << " ns/assign=" << sharedWriteNs / n
+                  << " snapshot ns/find=" << findNs / n
+                  << " Map copy us=" << copyNs / copies / 1000
+                  << " snapshot us=" << snapshotNs / copies / 1000 << std::endl;
+    }
+}
+
+// Inserts, finds and a full scan, timed on one map type
+template<typename MapType>
+static void btreeRow(const char* name, const std::vector<int>& keys, const std::vector<int>& probes) {
+    MapType m;
+
+    Clock::time_point start = Clock::now();
+    for (int k : keys) {
+        m.insert({k, k});
+    }
+    double insertNs = elapsedNs(start);
+
+    size_t rounds = (1 << 22) / keys.size();
+    long long sum = 0;
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (int k : probes) {
+            sum += m.find(k)->second;
+        }
+    }
+    double findNs = elapsedNs(start);
+
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (const auto& v : m) {
+            sum += v.second;
+        }
+    }
+    double scanNs = elapsedNs(start);
+
+    doNotOptimize(sum);
+    std::cout << "  n=" << keys.size() << " " << name
+              << " ns/insert=" << insertNs / keys.size()
+              << " ns/find=" << findNs / (rounds * keys.size())
+              << " ns/element scanned=" << scanNs / (rounds * keys.size()) << std::endl;
+}
+
+// BTreeMap against Map and std::map. The B+ tree reads a few nodes of
+// several keys each per lookup, and scans run through contiguous leaves
+static void btreeComparison() {
+    std::cout << "btree" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 15);
+        std::vector<int> probes = shuffledKeys(n, 16);
+
+        btreeRow<BTreeMap<int, int>>("BTreeMap", keys, probes);
+        btreeRow<Map<int, int>>("Map", keys, probes);
+        btreeRow<std::map<int, int>>("std::map", keys, probes);
+    }
+}
+
+// Building a read-only table from shuffled pairs, then looking up and
+// scanning it, for FlatMap against Map. Also times converting between them
+static void flatMapComparison() {
+    std::cout << "flat_map" << std::endl;
+
+    for (size_t n = 1 << 10; n <= (1 << 20); n <<= 5) {
+        std::vector<int> keys = shuffledKeys(n, 17);
+        std::vector<int> probes = shuffledKeys(n, 18);
+        std::vector<std::pair<int, int>> pairs;
+        for (int k : keys) {
+            pairs.push_back({k, k});
+        }
+
+        Clock::time_point start = Clock::now();
+        Map<int, int> m(pairs.begin(), pairs.end());
+        double mapBuildNs = elapsedNs(start);
+
+        start = Clock::now();
+        FlatMap<int, int> f(pairs.begin(), pairs.end());
+        double flatBuildNs = elapsedNs(start);
+
+        size_t rounds = (1 << 22) / n;
+        long long sum = 0;
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (int k : probes) {
+                sum += m.find(k)->second;
+            }
+        }
+        double mapFindNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (int k : probes) {
+                sum += f.find(k)->second;
+            }
+        }
+        double flatFindNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (const auto& v : m) {
+                sum += v.second;
+            }
+        }
+        double mapScanNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (auto v : f) {
+                sum += v.second;
+            }
+        }
+        double flatScanNs = elapsedNs(start);
+
+        start = Clock::now();
+        FlatMap<int, int> fromMap(m);
+        double toFlatNs = elapsedNs(start);
+
+        start = Clock::now();
+        Map<int, int> fromFlat = f.to_map();
+        double toMapNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        doNotOptimize(fromMap.size() + fromFlat.size());
+        std::cout << "  n=" << n
+                  << " Map ns/build=" << mapBuildNs / n
+                  << " FlatMap ns/build=" << flatBuildNs / n
+                  << " Map ns/find=" << mapFindNs / (rounds * n)
+                  << " FlatMap ns/find=" << flatFindNs / (rounds * n)
+                  << " Map ns/scanned=" << mapScanNs / (rounds * n)
+                  << " FlatMap ns/scanned=" << flatScanNs / (rounds * n)
+                  << " Map->FlatMap ns/element=" << toFlatNs / n
+                  << " FlatMap->Map ns/element=" << toMapNs / n << std::endl;
+    }
+}
+
+// Scaling of the parallel algorithms with the number of threads, against
+// building sequentially, by inserting or by sorting first, and summing the
+// values with a loop over the iterators
+static void parallelScaling() {
+    std::cout << "parallel" << std::endl;
+
+    const size_t n = 1 << 20;
+    std::vector<int> keys = shuffledKeys(n, 19);
+    std::vector<std::pair<int, int>> pairs;
+    for (int k : keys) {
+        pairs.push_back({k, k});
+    }
+
+    Clock::time_point start = Clock::now();
+    Map<int, int> inserted(pairs.begin(), pairs.end());
+    double insertNs = elapsedNs(start);
+    doNotOptimize(inserted.size());
+
+    // Sorting first also lays the nodes out in key order, which the scans
+    // below depend on, so the sequential scan uses this map
+    start = Clock::now();
+    std::vector<std::pair<int, int>> sorted = pairs;
+    std::sort(sorted.begin(), sorted.end());
+    Map<int, int> m(sorted_unique, sorted.begin(), sorted.end());
+    double sortedBuildNs = elapsedNs(start);
+
+    const int rounds = 8;
+    long long sum = 0;
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (const auto& v : m) {
+            sum += v.second;
+        }
+    }
+    double scanNs = elapsedNs(start);
+
+    std::cout << "  sequential ms/insert all=" << insertNs / 1e6
+              << " ms/sort and build=" << sortedBuildNs / 1e6
+              << " ms/sum=" << scanNs / rounds / 1e6 << std::endl;
+
+    for (unsigned threads = 1; threads <= 16; threads *= 2) {
+        ThreadPool pool(threads);
+
+        start = Clock::now();
+        Map<int, int> built(par.on(pool), pairs.begin(), pairs.end());
+        double parallelBuildNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            built.for_each(par.on(pool), [](std::pair<const int, int>& v) { v.second++; });
+        }
+        double forEachNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            sum += built.reduce(par.on(pool), 0LL, std::plus<long long>());
+        }
+        double reduceNs = elapsedNs(start);
+
+        std::cout << "  threads=" << threads
+                  << " ms/build=" << parallelBuildNs / 1e6
+                  << " ms/for_each=" << forEachNs / rounds / 1e6
+                  << " ms/reduce=" << reduceNs / rounds / 1e6 << std::endl;
+    }
+
+    doNotOptimize(sum);
+}
+
+// Set operations of a map of 2^20 keys with maps of 16 to 2^20 keys, about
+// half of them shared, against the same result built element by element.
+// The union and intersection add up the values of shared keys
+static void setOperations() {
+    std::cout << "set_operations" << std::endl;
+
+    const size_t n = 1 << 20;
+    Map<int, int> master;
+    for (int k : shuffledKeys(n, 20)) {
+        master.insert({2 * k, k});
+    }
+
+    std::mt19937 rng(21);
+    for (size_t m = 16; m <= n; m *= 16) {
+        Map<int, int> small;
+        while (small.size() < m) {
+            int k = static_cast<int>(rng() % (2 * n));
+            small.insert({k, k});
+        }
+
+        Map<int, int> a = master;
+        Map<int, int> b = small;
+        Clock::time_point start = Clock::now();
+        a.union_with(b, std::plus<int>());
+        double unionNs = elapsedNs(start);
+
+        a = master;
+        start = Clock::now();
+        for (const auto& v : small) {
+            auto result = a.try_emplace(v.first, v.second);
+            if (!result.second) {
+                result.first->second += v.second;
+            }
+        }
+        double insertNs = elapsedNs(start);
+
+        a = master;
+        start = Clock::now();
+        a.intersect_with(small, std::plus<int>());
+        double intersectNs = elapsedNs(start);
+
+        a = master;
+        start = Clock::now();
+        Map<int, int> kept;
+        for (const auto& v : small) {
+            auto it = a.find(v.first);
+            if (it != a.end()) {
+                kept.insert(kept.end(), {v.first, it->second + v.second});
+            }
+        }
+        a = std::move(kept);
+        double findNs = elapsedNs(start);
+
+        a = master;
+        start = Clock::now();
+        a.difference_with(small);
+        double differenceNs = elapsedNs(start);
+
+        a = master;
+        start = Clock::now();
+        for (const auto& v : small) {
+            a.erase(v.first);
+        }
+        double eraseNs = elapsedNs(start);
+
+        doNotOptimize(a.size());
+        std::cout << "  m=" << m
+                  << " ms/union_with=" << unionNs / 1e6
+                  << " ms/insert loop=" << insertNs / 1e6
+                  << " ms/intersect_with=" << intersectNs / 1e6
+                  << " ms/find loop=" << findNs / 1e6
+                  << " ms/difference_with=" << differenceNs / 1e6
+                  << " ms/erase loop=" << eraseNs / 1e6 << std::endl;
+    }
+
+    Map<int, int> other;
+    for (int k : shuffledKeys(n, 22)) {
+        other.insert({2 * k + 1, k});
+    }
+
+    for (unsigned threads = 1; threads <= 16; threads *= 2) {
+        ThreadPool pool(threads);
+        Map<int, int> a = master;
+        Map<int, int> b = other;
+
+        Clock::time_point start = Clock::now();
+        a.union_with(par.on(pool), b);
+        double unionNs = elapsedNs(start);
+
+        doNotOptimize(a.size());
+        std::cout << "  threads=" << threads << " m=" << n
+                  << " ms/parallel union_with=" << unionNs / 1e6 << std::endl;
+    }
+}
+
+// Moving the upper half of a map into a new map and back, by split and join
+// versus by inserting into the new map and erasing from the old one. split
+// counts the smaller half unless the map keeps subtree sizes
+template<typename MapType>
+static void splitJoinRow(const char* name, const std::vector<int>& keys) {
+    MapType m;
+    for (int k : keys) {
+        m.insert({k, k});
+    }
+
+    const int middle = static_cast<int>(keys.size() / 2);
+    const int rounds = 16;
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        auto halves = m.split(middle);
+        m = MapType::join(std::move(halves.first), std::move(halves.second));
+    }
+    double splitJoinNs = elapsedNs(start);
+
+    start = Clock::now();
+    MapType upper;
+    for (auto it = m.lower_bound(middle); it != m.end();) {
+        upper.insert(upper.end(), *it);
+        it = m.erase(it);
+    }
+    for (const auto& v : upper) {
+        m.insert(m.end(), v);
+    }
+    double loopNs = elapsedNs(start);
+
+    doNotOptimize(m.size() + upper.size());
+    std::cout << "  " << name << " n=" << keys.size()
+              << " us/split and join=" << splitJoinNs / rounds / 1e3
+              << " us/insert and erase loop=" << loopNs / 1e3 << std::endl;
+}
+
+static void splitJoin() {
+    std::cout << "split_join" << std::endl;
+
+    std::vector<int> keys = shuffledKeys(1 << 20, 23);
+    splitJoinRow<Map<int, int>>("Map", keys);
+    splitJoinRow<Map<int, int, std::less<int>, std::allocator<std::pair<const int, int>>, OrderStatistics>>("Map with OrderStatistics", keys);
+}
+
+// Erasing a window of k consecutive keys from a map of 2^20 keys with the
+// range erase, against erasing the same keys one iterator at a time
+static void rangeErase() {
+    std::cout << "range_erase" << std::endl;
+
+    const size_t n = 1 << 20;
+    Map<int, int> master;
+    for (int k : shuffledKeys(n, 24)) {
+        master.insert({k, k});
+    }
+
+    for (size_t k = 4; k <= n / 2; k *= 8) {
+        const int lo = static_cast<int>(n / 4);
+        const int hi = lo + static_cast<int>(k);
+
+        Map<int, int> m = master;
+        Clock::time_point start = Clock::now();
+        m.erase(lo, hi);
+        double rangeNs = elapsedNs(start);
+
+        m = master;
+        start = Clock::now();
+        for (auto it = m.lower_bound(lo); it != m.end() && it->first < hi;) {
+            it = m.erase(it);
+        }
+        double loopNs = elapsedNs(start);
+
+        doNotOptimize(m.size());
+        std::cout << "  k=" << k
+                  << " us/range erase=" << rangeNs / 1e3
+                  << " us/erase loop=" << loopNs / 1e3 << std::endl;
+    }
+}
+
+// Looking up sorted batches of keys with find_batch and lower_bound_batch,
+// against calling find and lower_bound for every key, in a map of 2^20 keys. Denser batches leave smaller gaps
+// between the keys, so more of each lookup is saved
+static void findBatch() {
+    std::cout << "find_batch" << std::endl;
+
+    const size_t n = 1 << 20;
+    Map<int, int> m;
+    for (int k : shuffledKeys(n, 25)) {
+        m.insert({k, k});
+    }
+
+    std::mt19937 rng(26);
+    for (size_t k = 1 << 8; k <= n; k *= 16) {
+        std::vector<int> probes(k);
+        for (int& p : probes) {
+            p = static_cast<int>(rng() % n);
+        }
+        std::sort(probes.begin(), probes.end());
+
+        std::vector<Map<int, int>::iterator> results(k);
+        const int rounds = static_cast<int>(std::max<size_t>(1, (1 << 22) / k));
+        long long sum = 0;
+
+        Clock::time_point start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < k; i++) {
+                results[i] = m.find(probes[i]);
+            }
+            sum += results[k / 2]->second;
+        }
+        double findNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            m.find_batch(probes.begin(), probes.end(), results.begin());
+            sum += results[k / 2]->second;
+        }
+        double batchNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < k; i++) {
+                results[i] = m.lower_bound(probes[i]);
+            }
+            sum += results[k / 2]->second;
+        }
+        double lowerBoundNs = elapsedNs(start);
+
+        start = Clock::now();
+        for (int r = 0; r < rounds; r++) {
+            m.lower_bound_batch(probes.begin(), probes.end(), results.begin());
+            sum += results[k / 2]->second;
+        }
+        double lowerBoundBatchNs = elapsedNs(start);
+
+        doNotOptimize(sum);
+        std::cout << "  k=" << k
+                  << " ns/find=" << findNs / (rounds * k)
+                  << " ns/find_batch key=" << batchNs / (rounds * k)
+                  << " ns/lower_bound=" << lowerBoundNs / (rounds * k)
+                  << " ns/lower_bound_batch key=" << lowerBoundBatchNs / (rounds * k) << std::endl;
+    }
+}
+
+// Random lookups one at a time with find, against find_many interleaving
+// them, as the map outgrows the caches. The maps are built from sorted
+// keys to keep the setup short
+static void findMany() {
+    std::cout << "find_many" << std::endl;
+
+    for (size_t n = 1 << 14; n <= (1 << 23); n *= 8) {
+        std::vector<std::pair<int, int>> sorted(n);
+        for (size_t i = 0; i < n; i++) {
+            sorted[i] = {static_cast<int>(i), static_cast<int>(i)};
+        }
+        Map<int, int> m(sorted_unique, sorted.begin(), sorted.end());
+
+        const size_t k = 1 << 20;
+        std::mt19937 rng(27);
+        std::vector<int> probes(k);
+        for (int& p : probes) {
+            p = static_cast<int>(rng() % n);
+        }
+        std::vector<Map<int, int>::iterator> results(k);
+        long long sum = 0;
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < k; i++) {
+            results[i] = m.find(probes[i]);
+        }
+        double findNs = elapsedNs(start);
+        sum += results[k / 2]->second;
+
+        start = Clock::now();
+        m.find_many(probes.begin(), probes.end(), results.begin());
+        double manyNs = elapsedNs(start);
+        sum += results[k / 2]->second;
+
+        doNotOptimize(sum);
+        std::cout << "  n=" << n
+                  << " ns/find=" << findNs / k
+                  << " ns/find_many key=" << manyNs / k << std::endl;
+    }
+}
+
+// n draws from a Zipfian distribution with exponent 0.99 over the keys 0
+// to n - 1. The popular keys are scattered over the key space rather than
+// being the smallest ones
+static std::vector<int> zipfianKeys(size_t n, unsigned seed) {
+    std::vector<double> cdf(n);
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += 1.0 / std::pow(double(i + 1), 0.99);
+        cdf[i] = total;
+    }
+
+    std::vector<int> byRank = shuffledKeys(n, seed);
+    std::mt19937 rng(seed + 1);
+    std::uniform_real_distribution<double> uniform(0, total);
+    std::vector<int> keys(n);
+
+    for (int& k : keys) {
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+        k = byRank[std::min(rank, n - 1)];
+    }
+    return keys;
+}
+
+// Resident set size of this process in kilobytes
+static long residentKb() {
+    long pages = 0;
+    long resident = 0;
+
+    if (FILE* statm = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        std::fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Highest resident set size this process has reached, in kilobytes
+static long peakResidentKb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Time and allocations of one operation of map_vs_std, summed over rounds
+struct OpCost {
+    const char* op;
+    double ns = 0;
+    size_t allocations = 0;
+    size_t count = 0;
+};
+
+// Runs body, which works on count elements, and adds its cost to cost
+template<typename F>
+static void measure(OpCost& cost, size_t count, F body) {
+    size_t allocations = allocationCount;
+    Clock::time_point start = Clock::now();
+    body();
+    cost.ns += elapsedNs(start);
+    cost.allocations += allocationCount - allocations;
+    cost.count += count;
+}
+
+// Runs every operation of map_vs_std on a MapType, inserting keys in their
+// order and looking up probes, and prints one CSV row per operation. The
+// peak RSS is counted from the resident size before the first round
+template<typename MapType, typename K>
+static void compareRun(const char* container, const char* kind, const std::vector<K>& keys,
+                       const std::vector<K>& probes, size_t rounds) {
+    enum { Insert, Subscript, Find, LowerBound, Iterate, Copy, Clear, EraseKey, EraseIterator, EraseRange };
+    OpCost costs[] = {{"insert"}, {"operator[]"}, {"find"}, {"lower_bound"}, {"iterate"},
+                      {"copy"}, {"clear"}, {"erase_key"}, {"erase_iterator"}, {"erase_range"}};
+    long baseKb = residentKb();
+    long long sum = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        MapType m;
+
+        measure(costs[Insert], keys.size(), [&] {
+            for (const K& k : keys) {
+                m.insert({k, 1});
+            }
+        });
+        measure(costs[Find], probes.size(), [&] {
+            for (const K& k : probes) {
+                sum += m.find(k)->second;
+            }
+        });
+        measure(costs[LowerBound], probes.size(), [&] {
+            for (const K& k : probes) {
+                sum += m.lower_bound(k)->second;
+            }
+        });
+        measure(costs[Iterate], m.size(), [&] {
+            for (const auto& kv : m) {
+                sum += kv.second;
+            }
+        });
+
+        std::optional<MapType> copy;
+        measure(costs[Copy], m.size(), [&] {
+            copy.emplace(m);
+        });
+        measure(costs[Clear], copy->size(), [&] {
+            copy->clear();
+        });
+        measure(costs[EraseKey], keys.size(), [&] {
+            for (const K& k : keys) {
+                sum += m.erase(k);
+            }
+        });
+
+        // Counts occurrences from an empty map, which for Zipfian probes
+        // is mostly increments of keys already there
+        measure(costs[Subscript], probes.size(), [&] {
+            for (const K& k : probes) {
+                m[k] += 1;
+            }
+        });
+        measure(costs[EraseIterator], m.size(), [&] {
+            for (auto it = m.begin(); it != m.end(); ) {
+                it = m.erase(it);
+            }
+        });
+
+        for (const K& k : keys) {
+            m.insert({k, 1});
+        }
+        measure(costs[EraseRange], m.size(), [&] {
+            while (!m.empty()) {
+                auto last = m.begin();
+                for (int i = 0; i < 64 && last != m.end(); i++) {
+                    ++last;
+                }
+                m.erase(m.begin(), last);
+            }
+        });
+    }
+
+    doNotOptimize(sum);
+    long peakKb = peakResidentKb() - baseKb;
+
+    for (const OpCost& cost : costs) {
+        std::cout << container << ',' << kind << ',' << keys.size() << ',' << cost.op << ','
+                  << cost.ns / cost.count << ',' << double(cost.allocations) / cost.count << ','
+                  << peakKb << '\n';
+    }
+    std::cout.flush();
+}
+
+// Runs run in a child process, so that every run starts from a fresh peak
+// RSS and gets back the memory the previous one used
+template<typename F>
+static void inChildProcess(F run) {
+    std::cout.flush();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        run();
+        _exit(0);
+    }
+
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "map_vs_std: a run did not finish" << std::endl;
+    }
+}
+
+// Runs map_vs_std on Map and std::map with the keys and probes make builds.
+// They are built in the child, so that their pages count as resident before
+// the first round
+template<typename K, typename Make>
+static void compareKeys(const char* kind, size_t n, Make make) {
+    size_t rounds = std::max<size_t>(1, 1000000 / n);
+
+    inChildProcess([&] {
+        std::vector<K> keys, probes;
+        make(keys, probes);
+        compareRun<Map<K, int>>("Map", kind, keys, probes, rounds);
+    });
+    inChildProcess([&] {
+        std::vector<K> keys, probes;
+        make(keys, probes);
+        compareRun<std::map<K, int>>("std::map", kind, keys, probes, rounds);
+    });
+}
+
+// Map against std::map for every operation, with sequential, random,
+// Zipfian and string keys at 10^3 to 10^7 elements. Prints a CSV table with
+// the time and allocations per element and the peak RSS of each run.
+// Small sizes are repeated for about 10^6 elements per operation
+static void mapVsStd() {
+    std::cout << "map_vs_std" << std::endl;
+    std::cout << "container,keys,n,op,ns_per_op,allocations_per_op,peak_rss_kb" << std::endl;
+
+    for (size_t n = 1000; n <= 10000000; n *= 10) {
+        compareKeys<int>("sequential", n, [n](std::vector<int>& keys, std::vector<int>& probes) {
+            keys.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                keys[i] = static_cast<int>(i);
+            }
+            probes = keys;
+        });
+        compareKeys<int>("random", n, [n](std::vector<int>& keys, std::vector<int>& probes) {
+            keys = shuffledKeys(n, 28);
+            probes = shuffledKeys(n, 29);
+        });
+        compareKeys<int>("zipfian", n, [n](std::vector<int>& keys, std::vector<int>& probes) {
+            keys = shuffledKeys(n, 28);
+            probes = zipfianKeys(n, 30);
+        });
+        compareKeys<std::string>("string", n, [n](std::vector<std::string>& keys, std::vector<std::string>& probes) {
+            keys = stringKeys(n, 32);
+            probes = stringKeys(n, 33);
+        });
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"insert_scaling", insertScaling},
+    {"allocator", allocator},
+    {"find", findThroughput},
+    {"hinted_insert", hintedInsert},
+    {"sorted_build", sortedBuild},
+    {"copy_assign", copyAssign},
+    {"order_statistics", orderStatistics},
+    {"aggregate", rangeAggregate},
+    {"string_keys", stringKeysBenchmark},
+    {"concurrent_reads", concurrentReads},
+    {"batched_writes", batchedWrites},
+    {"persistent", persistentSnapshots},
+    {"btree", btreeComparison},
+    {"flat_map", flatMapComparison},
+    {"parallel", parallelScaling},
+    {"set_operations", setOperations},
+    {"split_join", splitJoin},
+    {"range_erase", rangeErase},
+    {"find_batch", findBatch},
+    {"find_many", findMany},
+    {"map_vs_std", mapVsStd},
+};
+
+int main(int argc, char** argv) {
+    for (const Benchmark& b : benchmarks) {
+        bool selected = (argc == 1);
+
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], b.name) == 0) {
+                selected = true;
+            }
+        }
+
+        if (selected) {
+            b.run();
+        }
+    }
+}
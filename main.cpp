@@ -1,5 +1,6 @@
 #include "Map.h"
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
 // Used for printing out pairs
@@ -19,6 +20,30 @@ std::ostream& operator<<(std::ostream& os, const Map<Key, Val>& m) {
     return os;
 }
 
+// Value whose copy constructor throws once copiesLeft reaches zero. A
+// negative copiesLeft never throws
+struct Fragile {
+    static inline int copiesLeft = -1;
+    int n;
+
+    Fragile(int v = 0): n(v) {}
+
+    Fragile(const Fragile& other): n(other.n) {
+        if (copiesLeft == 0) {
+            throw std::runtime_error("copy failed");
+        }
+        if (copiesLeft > 0) {
+            copiesLeft--;
+        }
+    }
+
+    Fragile& operator=(const Fragile&) = default;
+};
+
+std::ostream& operator<<(std::ostream& os, const Fragile& f) {
+    return os << f.n;
+}
+
 int main() {
     // Aliasing map iterator types
     using iterator = Map<int, std::string>::iterator;
@@ -305,6 +330,41 @@ int main() {
 
 
 
+    // emplace, try_emplace and insert_or_assign
+    m6.emplace(3, "Three");
+    std::cout << "Emplaced 3" << std::endl;
+
+    m6.try_emplace(3, "Tres");
+    std::cout << "try_emplace(3) keeps the existing value" << std::endl;
+
+    m6.insert_or_assign(7, "Siete");
+    std::cout << "Assigned Siete to 7" << std::endl << std::endl;
+
+    std::cout << "Size of m6: " << m6.size() << std::endl;
+    std::cout << "Contents of m6: " << m6 << std::endl << std::endl;
+
+
+
+
+    // extract and merge
+    Map<int, std::string> m7 = {{4, "Four"}, {5, "Five"}, {7, "Seven"}};
+    auto node = m7.extract(4);
+    node.key() = 8;
+    m6.insert(std::move(node));
+    std::cout << "Moved 4 out of m7 and into m6 as 8" << std::endl;
+
+    m6.merge(m7);
+    std::cout << "Merged m7 into m6" << std::endl << std::endl;
+
+    std::cout << "Size of m6: " << m6.size() << std::endl;
+    std::cout << "Contents of m6: " << m6 << std::endl << std::endl;
+
+    std::cout << "Size of m7: " << m7.size() << std::endl;
+    std::cout << "Contents of m7: " << m7 << std::endl << std::endl;
+
+
+
+
     // clear
     std::cout << "Clearing m6..." << std::endl;
     m6.clear();
@@ -315,6 +375,37 @@ int main() {
 
 
 
+    // Copy assignment that throws
+    Map<int, Fragile> m8;
+    for (int i = 1; i <= 5; i++) {
+        m8.insert({i, Fragile(i)});
+    }
+    Map<int, Fragile> m9 = {{7, Fragile(7)}, {8, Fragile(8)}, {9, Fragile(9)}};
+
+    try {
+        std::cout << "Assigning m8 to m9, with the 3rd value copy failing..." << std::endl;
+        Fragile::copiesLeft = 2;
+        m9 = m8;
+        std::cout << "No error!" << std::endl << std::endl;
+    } catch (const std::runtime_error&) {
+        std::cout << "The copy failed and m9 was left empty" << std::endl << std::endl;
+    }
+    Fragile::copiesLeft = -1;
+
+    std::cout << "Size of m9: " << m9.size() << std::endl;
+    std::cout << "m9 is empty: " << (m9.begin() == m9.end() ? "yes" : "no") << std::endl;
+    std::cout << "Contents of m9: " << m9 << std::endl << std::endl;
+
+    m9 = m8;
+    m9[6] = Fragile(6);
+    std::cout << "Assigned m8 to m9 again and added 6" << std::endl;
+    std::cout << "Size of m9: " << m9.size() << std::endl;
+    std::cout << "Contents of m9: " << m9 << std::endl << std::endl;
+
+
+
+
+
     // Destructor
     std::cout << "Deleting all maps..." << std::endl;
 }
\ No newline at end of file